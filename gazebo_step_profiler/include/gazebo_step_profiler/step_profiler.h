@@ -0,0 +1,233 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: Low-overhead timing histograms for the per-step paths of Gazebo
+ *       plugins, reported on /diagnostics. Compiled in with this
+ *       package's ENABLE_PROFILING CMake option, which every package
+ *       finding it inherits; without it every type here is an empty stub
+ *       the compiler removes.
+ */
+
+#ifndef GAZEBO_STEP_PROFILER_STEP_PROFILER_H
+#define GAZEBO_STEP_PROFILER_STEP_PROFILER_H
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/lexical_cast.hpp>
+#include <diagnostic_msgs/DiagnosticStatus.h>
+#include <diagnostic_msgs/KeyValue.h>
+
+#ifdef GAZEBO_STEP_PROFILER_ENABLED
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#endif
+
+namespace gazebo {
+
+#ifdef GAZEBO_STEP_PROFILER_ENABLED
+
+  /// \brief Monotonic clock in nanoseconds (a vDSO read, no system call).
+  inline uint64_t profilerNow()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /// \brief Log-linear histogram of durations, four buckets per power of two.
+  ///
+  /// record() may be called from any number of threads and costs a couple of
+  /// relaxed atomic adds. collect() summarizes everything recorded since the
+  /// previous collect() and must only be called from one thread.
+  class StepHistogram {
+
+    public:
+      static const bool kCompiledIn = true;
+
+      struct Summary {
+        uint64_t count;
+        double mean_us;
+        double p50_us;
+        double p99_us;
+        double max_us;
+      };
+
+      StepHistogram() : total_ns_(0), max_ns_(0), previous_total_ns_(0)
+      {
+        for (int i = 0; i < kBuckets; ++i) {
+          counts_[i] = 0;
+          previous_counts_[i] = 0;
+        }
+      }
+
+      void record(uint64_t ns)
+      {
+        counts_[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+        total_ns_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = max_ns_.load(std::memory_order_relaxed);
+        while (ns > max && !max_ns_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+      }
+
+      Summary collect()
+      {
+        uint64_t window[kBuckets];
+        uint64_t count = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+          const uint64_t current = counts_[i].load(std::memory_order_relaxed);
+          window[i] = current - previous_counts_[i];
+          previous_counts_[i] = current;
+          count += window[i];
+        }
+        const uint64_t total_ns = total_ns_.load(std::memory_order_relaxed);
+
+        const double max_ns = static_cast<double>(max_ns_.exchange(0, std::memory_order_relaxed));
+
+        // Bucket edges overshoot by up to 25%; never report more than the max.
+        Summary summary;
+        summary.count = count;
+        summary.mean_us = count > 0 ? (total_ns - previous_total_ns_) * 1e-3 / count : 0.0;
+        summary.p50_us = std::min(percentile(window, count, 0.50), max_ns) * 1e-3;
+        summary.p99_us = std::min(percentile(window, count, 0.99), max_ns) * 1e-3;
+        summary.max_us = max_ns * 1e-3;
+        previous_total_ns_ = total_ns;
+        return summary;
+      }
+
+    private:
+      static const int kSubBucketBits = 2;
+      static const int kBuckets = 64 << kSubBucketBits;
+
+      static int bucketIndex(uint64_t ns)
+      {
+        if (ns < (1u << kSubBucketBits))
+          return static_cast<int>(ns);
+        const int msb = 63 - __builtin_clzll(ns);
+        const int sub = static_cast<int>(ns >> (msb - kSubBucketBits)) & ((1 << kSubBucketBits) - 1);
+        return (msb << kSubBucketBits) + sub;
+      }
+
+      /// \brief Upper edge of a bucket, in nanoseconds.
+      static double bucketValue(int index)
+      {
+        const int msb = index >> kSubBucketBits;
+        if (msb < kSubBucketBits)
+          return index;
+        const int sub = index & ((1 << kSubBucketBits) - 1);
+        return static_cast<double>(static_cast<uint64_t>((1 << kSubBucketBits) + sub + 1)
+                                   << (msb - kSubBucketBits));
+      }
+
+      static double percentile(const uint64_t* window, uint64_t count, double fraction)
+      {
+        if (count == 0)
+          return 0.0;
+        const uint64_t rank = static_cast<uint64_t>(fraction * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+          seen += window[i];
+          if (seen >= rank)
+            return bucketValue(i);
+        }
+        return bucketValue(kBuckets - 1);
+      }
+
+      std::atomic<uint64_t> counts_[kBuckets];
+      std::atomic<uint64_t> total_ns_;
+      std::atomic<uint64_t> max_ns_;
+
+      // Owned by the collecting thread.
+      uint64_t previous_counts_[kBuckets];
+      uint64_t previous_total_ns_;
+  };
+
+  /// \brief Records the lifetime of the scope into a histogram, if given one.
+  class ScopedStepTimer {
+
+    public:
+      explicit ScopedStepTimer(StepHistogram* histogram)
+        : histogram_(histogram), start_(histogram ? profilerNow() : 0) {}
+
+      ~ScopedStepTimer()
+      {
+        if (histogram_)
+          histogram_->record(profilerNow() - start_);
+      }
+
+    private:
+      StepHistogram* histogram_;
+      uint64_t start_;
+  };
+
+#else
+
+  inline uint64_t profilerNow() { return 0; }
+
+  class StepHistogram {
+
+    public:
+      static const bool kCompiledIn = false;
+
+      struct Summary {
+        uint64_t count;
+        double mean_us;
+        double p50_us;
+        double p99_us;
+        double max_us;
+      };
+
+      void record(uint64_t) {}
+
+      Summary collect()
+      {
+        Summary summary = { 0, 0.0, 0.0, 0.0, 0.0 };
+        return summary;
+      }
+  };
+
+  class ScopedStepTimer {
+
+    public:
+      explicit ScopedStepTimer(StepHistogram*) {}
+  };
+
+#endif
+
+  /// \brief Append one histogram's summary to a diagnostic status.
+  inline void appendSummary(diagnostic_msgs::DiagnosticStatus& status, const std::string& name,
+                            const StepHistogram::Summary& summary)
+  {
+    diagnostic_msgs::KeyValue value;
+    value.key = name + " count";
+    value.value = boost::lexical_cast<std::string>(summary.count);
+    status.values.push_back(value);
+    value.key = name + " mean (us)";
+    value.value = boost::lexical_cast<std::string>(summary.mean_us);
+    status.values.push_back(value);
+    value.key = name + " p50 (us)";
+    value.value = boost::lexical_cast<std::string>(summary.p50_us);
+    status.values.push_back(value);
+    value.key = name + " p99 (us)";
+    value.value = boost::lexical_cast<std::string>(summary.p99_us);
+    status.values.push_back(value);
+    value.key = name + " max (us)";
+    value.value = boost::lexical_cast<std::string>(summary.max_us);
+    status.values.push_back(value);
+  }
+
+}
+
+#endif /* end of include guard: GAZEBO_STEP_PROFILER_STEP_PROFILER_H */
@@ -25,16 +25,28 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 #include <gazebo/common/Events.hh>
 #include <gazebo/common/Plugin.hh>
-#include <gazebo/physics/ode/ODESurfaceParams.hh>
 #include <gazebo/physics/physics.hh>
+#include <ignition/math/Pose3.hh>
+#include <ignition/math/Quaternion.hh>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <gazebo_step_profiler/step_profiler.h>
 #include <ros/console.h>
+#include <ros/ros.h>
 
+#include <cmath>
+#include <limits>
 #include <string>
+#include <vector>
 
 
 namespace gazebo
 {
 
+/// Thread safety: each instance only writes the friction pyramids of its
+/// own wheel collisions, and it does so in WorldUpdateBegin, before the
+/// solver reads them. Gazebo calls those handlers one after another, also
+/// with ODE island threads, which only solve separate robots in parallel
+/// once the handlers ran. Instances share no state.
 class MecanumPlugin : public ModelPlugin
 {
 public:
@@ -44,13 +56,36 @@ protected:
   virtual void GazeboUpdate();
 
 private:
+  bool addWheel(const std::string& link_name, double roller_angle);
+  void publishDiagnostics(const ros::WallTimerEvent& event);
+
   event::ConnectionPtr update_connection_;
   physics::ModelPtr model_;
-  physics::LinkPtr wheel_link_;
   physics::LinkPtr fixed_link_;
-  double roller_angle_;
   double roller_friction_;
   double roller_skid_friction_;
+  double direction_epsilon_;
+
+  // One entry per wheel. A plugin given <wheelLinkName> drives a single wheel;
+  // one given a list of <wheel> elements drives the whole chassis from one
+  // update callback.
+  std::vector<physics::LinkPtr> wheel_links_;
+  std::vector<physics::FrictionPyramidPtr> friction_pyramids_;
+  std::vector<double> cos_roller_angles_;
+  std::vector<double> last_wheel_angles_;
+  // Wheels that turned past <directionEpsilon> this step, packed at the
+  // front, with their angle and new roller direction.
+  std::vector<size_t> changed_wheels_;
+  std::vector<double> changed_angles_;
+  std::vector<double> direction_x_;
+  std::vector<double> direction_z_;
+
+  // Per-step timing, published on /diagnostics when <diagnosticsRate> is positive.
+  bool profiling_;
+  StepHistogram update_histogram_;
+  boost::shared_ptr<ros::NodeHandle> rosnode_;
+  ros::Publisher diagnostics_pub_;
+  ros::WallTimer diagnostics_timer_;
 };
 
 // Register this plugin with the simulator
@@ -63,22 +98,6 @@ void MecanumPlugin::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf)
 
   std::string link_name;
 
-  if (_sdf->HasElement("wheelLinkName"))
-  {
-    link_name = _sdf->Get<std::string>("wheelLinkName");
-    wheel_link_ = model_->GetLink(link_name);
-    if (!wheel_link_)
-    {
-      ROS_FATAL_STREAM("Wheel link [" << link_name << "] not found!");
-      return;
-    }
-  }
-  else
-  {
-    ROS_FATAL("The mecanum plugin requires a `wheelLinkName` parameter.");
-    return;
-  }
-
   if (_sdf->HasElement("fixedLinkName"))
   {
     link_name = _sdf->Get<std::string>("fixedLinkName");
@@ -95,13 +114,14 @@ void MecanumPlugin::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf)
     return;
   }
 
+  double roller_angle;
   if (_sdf->HasElement("rollerAngle"))
   {
-    roller_angle_ = _sdf->Get<double>("rollerAngle");
+    roller_angle = _sdf->Get<double>("rollerAngle");
   }
   else
   {
-    roller_angle_ = M_PI / 4;
+    roller_angle = M_PI / 4;
   }
 
   if (_sdf->HasElement("rollerFriction"))
@@ -122,40 +142,182 @@ void MecanumPlugin::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf)
     roller_skid_friction_ = 100000;
   }
 
-  ROS_INFO_STREAM("Mecanum plugin initialized for " << wheel_link_->GetName() <<
-                  ", referenced to " << fixed_link_->GetName() << ", with a roller " <<
-                  "angle of " << roller_angle_ << " radians.");
+  if (_sdf->HasElement("directionEpsilon"))
+  {
+    direction_epsilon_ = _sdf->Get<double>("directionEpsilon");
+  }
+  else
+  {
+    direction_epsilon_ = 1e-4;
+  }
+
+  if (model_->GetWorld()->Physics()->GetType() != "ode")
+  {
+    ROS_FATAL_STREAM("The mecanum plugin requires the ODE physics engine, not [" <<
+                     model_->GetWorld()->Physics()->GetType() << "].");
+    return;
+  }
+
+  if (_sdf->HasElement("wheel"))
+  {
+    // Chassis mode: <wheel><linkName/><rollerAngle/></wheel> per wheel, with
+    // the plugin-level <rollerAngle> as the default.
+    for (sdf::ElementPtr wheel = _sdf->GetElement("wheel"); wheel; wheel = wheel->GetNextElement("wheel"))
+    {
+      if (!wheel->HasElement("linkName"))
+      {
+        ROS_FATAL("Each mecanum plugin `wheel` requires a `linkName` parameter.");
+        return;
+      }
+      double wheel_roller_angle = roller_angle;
+      if (wheel->HasElement("rollerAngle"))
+      {
+        wheel_roller_angle = wheel->Get<double>("rollerAngle");
+      }
+      if (!addWheel(wheel->Get<std::string>("linkName"), wheel_roller_angle))
+      {
+        return;
+      }
+    }
+  }
+  else if (_sdf->HasElement("wheelLinkName"))
+  {
+    if (!addWheel(_sdf->Get<std::string>("wheelLinkName"), roller_angle))
+    {
+      return;
+    }
+  }
+  else
+  {
+    ROS_FATAL("The mecanum plugin requires a `wheelLinkName` parameter or a list of `wheel` elements.");
+    return;
+  }
+
+  double diagnostics_rate = 0.0;
+  if (_sdf->HasElement("diagnosticsRate"))
+  {
+    diagnostics_rate = _sdf->Get<double>("diagnosticsRate");
+  }
+  profiling_ = diagnostics_rate > 0.0 && StepHistogram::kCompiledIn && ros::isInitialized();
+  if (profiling_)
+  {
+    // Timer callbacks run on the global queue spun by gazebo_ros.
+    rosnode_.reset(new ros::NodeHandle());
+    diagnostics_pub_ = rosnode_->advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+    diagnostics_timer_ = rosnode_->createWallTimer(ros::WallDuration(1.0 / diagnostics_rate),
+                                                   &MecanumPlugin::publishDiagnostics, this);
+  }
+  else if (diagnostics_rate > 0.0)
+  {
+    ROS_WARN("The mecanum plugin needs ENABLE_PROFILING and a ROS node for `diagnosticsRate`, ignoring it.");
+  }
+
+  changed_wheels_.resize(wheel_links_.size());
+  changed_angles_.resize(wheel_links_.size());
+  direction_x_.resize(wheel_links_.size());
+  direction_z_.resize(wheel_links_.size());
 
   // Register update event handler
   this->update_connection_ = event::Events::ConnectWorldUpdateBegin(
       boost::bind(&MecanumPlugin::GazeboUpdate, this));
 }
 
-void MecanumPlugin::GazeboUpdate()
+bool MecanumPlugin::addWheel(const std::string& link_name, double roller_angle)
 {
-  math::Pose wheel_pose = wheel_link_->GetWorldCoGPose();
-  math::Pose fixed_pose = fixed_link_->GetWorldCoGPose();
-  math::Quaternion wheel_orientation = wheel_pose.CoordRotationSub(fixed_pose.rot);
-  double wheel_angle = wheel_orientation.GetPitch();
-  ROS_DEBUG_STREAM(wheel_link_->GetName() << " angle is " << wheel_angle << " radians.");
+  physics::LinkPtr wheel_link = model_->GetLink(link_name);
+  if (!wheel_link)
+  {
+    ROS_FATAL_STREAM("Wheel link [" << link_name << "] not found!");
+    return false;
+  }
 
   // TODO: Understand better what the deal is with multiple collisions on a link.
   unsigned int collision_index = 0;
-  physics::SurfaceParamsPtr surface = wheel_link_->GetCollision(collision_index)->GetSurface();
+  physics::CollisionPtr collision = wheel_link->GetCollision(collision_index);
+  if (!collision)
+  {
+    ROS_FATAL_STREAM("Wheel link [" << link_name << "] has no collision.");
+    return false;
+  }
+  physics::SurfaceParamsPtr surface = collision->GetSurface();
+  physics::FrictionPyramidPtr fric = surface ? surface->FrictionPyramid() : physics::FrictionPyramidPtr();
+  if (!fric)
+  {
+    ROS_FATAL_STREAM("Wheel link [" << link_name << "] does not have a friction pyramid.");
+    return false;
+  }
 
-  // TODO: Check that the physics engine is ODE to avoid a segfault here.
-  physics::ODESurfaceParams* ode_surface = dynamic_cast<physics::ODESurfaceParams*>(surface.get());
-  physics::FrictionPyramid& fric(ode_surface->frictionPyramid);
+  // Only the roller direction follows the wheel; everything else is constant.
+  fric->SetMuPrimary(roller_skid_friction_);
+  fric->SetMuSecondary(roller_friction_);
+  fric->direction1.Y(sin(roller_angle));
 
-  // TODO: Parameterize these.
-  fric.SetMuPrimary(roller_skid_friction_);
-  fric.SetMuSecondary(roller_friction_);
+  wheel_links_.push_back(wheel_link);
+  friction_pyramids_.push_back(fric);
+  cos_roller_angles_.push_back(cos(roller_angle));
+  last_wheel_angles_.push_back(std::numeric_limits<double>::infinity());
+
+  ROS_INFO_STREAM("Mecanum plugin initialized for " << wheel_link->GetName() <<
+                  ", referenced to " << fixed_link_->GetName() << ", with a roller " <<
+                  "angle of " << roller_angle << " radians.");
+  return true;
+}
+
+void MecanumPlugin::publishDiagnostics(const ros::WallTimerEvent& event)
+{
+  diagnostic_msgs::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = ros::Time::now();
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = "MecanumPlugin: " + model_->GetName() + "/" + wheel_links_.front()->GetName();
+  status.hardware_id = model_->GetName();
+  status.message = "Per-step timing";
+  appendSummary(status, "GazeboUpdate", update_histogram_.collect());
+
+  diagnostics.status.push_back(status);
+  diagnostics_pub_.publish(diagnostics);
+}
+
+void MecanumPlugin::GazeboUpdate()
+{
+  ScopedStepTimer update_timer(profiling_ ? &update_histogram_ : NULL);
+
+  const size_t count = wheel_links_.size();
+  const ignition::math::Pose3d fixed_pose = fixed_link_->WorldCoGPose();
+
+  size_t changed = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const ignition::math::Pose3d wheel_pose = wheel_links_[i]->WorldCoGPose();
+    const ignition::math::Quaterniond wheel_orientation = wheel_pose.CoordRotationSub(fixed_pose.Rot());
+    const double wheel_angle = wheel_orientation.Pitch();
+    ROS_DEBUG_STREAM(wheel_links_[i]->GetName() << " angle is " << wheel_angle << " radians.");
+    if (std::abs(wheel_angle - last_wheel_angles_[i]) <= direction_epsilon_)
+    {
+      continue;
+    }
+    last_wheel_angles_[i] = wheel_angle;
+    changed_wheels_[changed] = i;
+    changed_angles_[changed] = wheel_angle;
+    ++changed;
+  }
 
   // TODO: Investigate replacing this manual trigonometry with Pose::rot::RotateVector. Doing this
   // would also make it easier to support wheels which rotate about an axis other than Y.
-  fric.direction1.x = cos(roller_angle_) * cos(wheel_angle);
-  fric.direction1.y = sin(roller_angle_);
-  fric.direction1.z = cos(roller_angle_) * sin(wheel_angle);
+  // Plain arrays with no calls into Gazebo, so the compiler is free to vectorize.
+  for (size_t j = 0; j < changed; ++j)
+  {
+    direction_x_[j] = cos(changed_angles_[j]);
+    direction_z_[j] = sin(changed_angles_[j]);
+  }
+
+  for (size_t j = 0; j < changed; ++j)
+  {
+    const size_t i = changed_wheels_[j];
+    friction_pyramids_[i]->direction1.X(cos_roller_angles_[i] * direction_x_[j]);
+    friction_pyramids_[i]->direction1.Z(cos_roller_angles_[i] * direction_z_[j]);
+  }
 }
 
 }  // namespace gazebo
@@ -0,0 +1,6 @@
+# Location of the baked headless worlds and meshes, see scripts/bake_media.
+@[if DEVELSPACE]@
+export RIDGEBACK_GAZEBO_MEDIA_CACHE="@(CATKIN_DEVEL_PREFIX)/@(CATKIN_PACKAGE_SHARE_DESTINATION)/media_cache"
+@[else]@
+export RIDGEBACK_GAZEBO_MEDIA_CACHE="$CATKIN_ENV_HOOK_WORKSPACE/@(CATKIN_PACKAGE_SHARE_DESTINATION)/media_cache"
+@[end if]@
@@ -0,0 +1,52 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: Debug-only heap allocation counter, enabled with the
+ *       COUNT_ALLOCATIONS CMake option.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_ALLOCATION_COUNTER_H
+#define RIDGEBACK_GAZEBO_PLUGINS_ALLOCATION_COUNTER_H
+
+#ifdef RIDGEBACK_GAZEBO_PLUGINS_COUNT_ALLOCATIONS
+
+#include <stdint.h>
+
+namespace gazebo {
+
+  /// \brief Number of operator new calls made on the calling thread by code
+  /// compiled into this library, plain, array, nothrow and (C++17) aligned
+  /// forms alike. Allocations inside other libraries (roscpp, gazebo) are
+  /// not seen.
+  uint64_t threadAllocationCount();
+
+  /// \brief Counts allocations made on this thread since construction.
+  class AllocationCounter {
+
+    public:
+      AllocationCounter() : start_(threadAllocationCount()) {}
+
+      uint64_t count() const { return threadAllocationCount() - start_; }
+
+    private:
+      uint64_t start_;
+  };
+
+}
+
+#endif /* RIDGEBACK_GAZEBO_PLUGINS_COUNT_ALLOCATIONS */
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_ALLOCATION_COUNTER_H */
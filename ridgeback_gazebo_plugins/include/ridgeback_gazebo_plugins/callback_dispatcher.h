@@ -0,0 +1,72 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: Process-wide callback queue serviced by a small worker pool, shared
+ *       by all force based move instances in a gzserver.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_CALLBACK_DISPATCHER_H
+#define RIDGEBACK_GAZEBO_PLUGINS_CALLBACK_DISPATCHER_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <ros/callback_queue.h>
+
+namespace gazebo {
+
+  /// \brief Shared callback queue with event-driven worker threads.
+  ///
+  /// Workers block on the queue's condition variable and only wake up
+  /// when a callback is added or the dispatcher is torn down, instead of
+  /// each plugin polling its own queue. Callbacks of a single subscription
+  /// are still serialized by roscpp, so single-producer assumptions in the
+  /// subscribers hold.
+  class CallbackDispatcher {
+
+    public:
+      /// \brief Get the process-wide dispatcher, starting it on first use.
+      /// \param num_threads Size of the worker pool. Only honoured by the
+      ///        first caller; later callers share the existing pool.
+      static boost::shared_ptr<CallbackDispatcher> acquire(unsigned int num_threads);
+
+      ~CallbackDispatcher();
+
+      ros::CallbackQueue* queue() { return &queue_; }
+
+    private:
+      explicit CallbackDispatcher(unsigned int num_threads);
+
+      void workerThread();
+
+      ros::CallbackQueue queue_;
+      boost::thread_group workers_;
+      std::atomic<bool> running_;
+
+      std::atomic<uint64_t> wakeups_;
+      std::atomic<uint64_t> callbacks_;
+
+      static boost::mutex instance_mutex_;
+      static boost::weak_ptr<CallbackDispatcher> instance_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_CALLBACK_DISPATCHER_H */
@@ -0,0 +1,108 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Admission check for cmd_vel messages, run in the ROS callback
+ *       before a command reaches the mailbox or the command mutex.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_COMMAND_INPUT_H
+#define RIDGEBACK_GAZEBO_PLUGINS_COMMAND_INPUT_H
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <stdint.h>
+
+namespace gazebo {
+
+  /// \brief Coalesces and rate limits velocity commands.
+  ///
+  /// Commands are stamped with the sim time of the step in progress, so
+  /// all commands with the same stamp arrive within one physics step. Only
+  /// the last of them is ever applied; without a rate limit they are let
+  /// through so the latest one wins, and counted as coalesced. With a
+  /// maximum rate, a command arriving sooner than 1 / rate of wall time
+  /// after the last admitted one is dropped before it costs a mailbox
+  /// write or a lock, whether or not sim time has moved. Wall time, because
+  /// a paused or slow simulation barely advances the step clock, and that
+  /// is when a flood of commands hurts most. Stop commands are always
+  /// admitted, so a robot can always be halted at once.
+  ///
+  /// configure() must happen before callbacks run. admit() may be called
+  /// from one callback at a time, the counters from any thread.
+  class CommandInputStage {
+
+    public:
+      CommandInputStage()
+        : min_interval_ns_(0), last_admitted_ns_(0), last_admitted_wall_ns_(0),
+          admitted_any_(false), received_(0), coalesced_(0), dropped_(0) {}
+
+      /// \param max_rate Commands per wall second, zero or negative for no limit.
+      void configure(double max_rate)
+      {
+        min_interval_ns_ = max_rate > 0.0 ? static_cast<int64_t>(std::llround(1e9 / max_rate)) : 0;
+      }
+
+      /// \return Whether the command should be passed on.
+      bool admit(double x, double y, double rot, int64_t now_ns)
+      {
+        return admit(x, y, rot, now_ns, min_interval_ns_ > 0 ? wallNanoseconds() : 0);
+      }
+
+      /// \param wall_ns Steady clock, only read with a rate limit.
+      bool admit(double x, double y, double rot, int64_t now_ns, int64_t wall_ns)
+      {
+        received_.fetch_add(1, std::memory_order_relaxed);
+        // Sim time going backwards is a world reset; start over.
+        if (now_ns < last_admitted_ns_)
+          admitted_any_ = false;
+        const bool stop = x == 0.0 && y == 0.0 && rot == 0.0;
+        if (admitted_any_ && !stop && wall_ns - last_admitted_wall_ns_ < min_interval_ns_) {
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        if (admitted_any_ && now_ns == last_admitted_ns_)
+          coalesced_.fetch_add(1, std::memory_order_relaxed);
+        admitted_any_ = true;
+        last_admitted_ns_ = now_ns;
+        last_admitted_wall_ns_ = wall_ns;
+        return true;
+      }
+
+      uint64_t received() const { return received_.load(std::memory_order_relaxed); }
+      uint64_t coalesced() const { return coalesced_.load(std::memory_order_relaxed); }
+      uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+      static int64_t wallNanoseconds()
+      {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+      }
+
+      int64_t min_interval_ns_;
+      int64_t last_admitted_ns_;
+      int64_t last_admitted_wall_ns_;
+      bool admitted_any_;
+      std::atomic<uint64_t> received_;
+      std::atomic<uint64_t> coalesced_;
+      std::atomic<uint64_t> dropped_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_COMMAND_INPUT_H */
@@ -0,0 +1,106 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: Single-producer/single-consumer velocity command slot shared
+ *       between the ROS callback thread and the Gazebo update thread.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_COMMAND_MAILBOX_H
+#define RIDGEBACK_GAZEBO_PLUGINS_COMMAND_MAILBOX_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include <gazebo/common/Time.hh>
+
+namespace gazebo {
+
+  /// \brief Seqlock holding the most recent velocity command.
+  ///
+  /// The writer never waits. The reader only retries while a write is in
+  /// flight, which is a handful of stores, so it never blocks on the writer
+  /// being descheduled while holding a lock. Exactly one thread may call
+  /// write() and exactly one thread may call read().
+  class CommandMailbox {
+
+    public:
+      struct Command {
+        double x;
+        double y;
+        double rot;
+        common::Time stamp;
+      };
+
+      CommandMailbox()
+        : sequence_(0), x_(0.0), y_(0.0), rot_(0.0), sec_(0), nsec_(0),
+          last_read_sequence_(0) {}
+
+      /// \brief Publish a new command. Producer thread only.
+      void write(const Command& cmd)
+      {
+        const uint32_t seq = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        x_.store(cmd.x, std::memory_order_relaxed);
+        y_.store(cmd.y, std::memory_order_relaxed);
+        rot_.store(cmd.rot, std::memory_order_relaxed);
+        sec_.store(cmd.stamp.sec, std::memory_order_relaxed);
+        nsec_.store(cmd.stamp.nsec, std::memory_order_relaxed);
+
+        sequence_.store(seq + 2, std::memory_order_release);
+      }
+
+      /// \brief Fetch the latest command. Consumer thread only.
+      /// \return false if nothing was written since the previous read.
+      bool read(Command& cmd)
+      {
+        for (;;) {
+          const uint32_t begin = sequence_.load(std::memory_order_acquire);
+          if (begin == last_read_sequence_)
+            return false;
+          if (begin & 1u)
+            continue;
+
+          cmd.x = x_.load(std::memory_order_relaxed);
+          cmd.y = y_.load(std::memory_order_relaxed);
+          cmd.rot = rot_.load(std::memory_order_relaxed);
+          cmd.stamp.sec = sec_.load(std::memory_order_relaxed);
+          cmd.stamp.nsec = nsec_.load(std::memory_order_relaxed);
+
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (sequence_.load(std::memory_order_relaxed) == begin) {
+            last_read_sequence_ = begin;
+            return true;
+          }
+        }
+      }
+
+    private:
+      std::atomic<uint32_t> sequence_;
+      std::atomic<double> x_;
+      std::atomic<double> y_;
+      std::atomic<double> rot_;
+      std::atomic<int32_t> sec_;
+      std::atomic<int32_t> nsec_;
+
+      /// \brief Owned by the consumer thread.
+      uint32_t last_read_sequence_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_COMMAND_MAILBOX_H */
@@ -0,0 +1,227 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Mass-aware planar velocity controller with acceleration and jerk
+ *       limited reference shaping.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_FEED_FORWARD_CONTROLLER_H
+#define RIDGEBACK_GAZEBO_PLUGINS_FEED_FORWARD_CONTROLLER_H
+
+#include <algorithm>
+#include <cmath>
+
+#include <gazebo/physics/physics.hh>
+#include <sdf/sdf.hh>
+
+namespace gazebo {
+
+  /// \brief Velocity reference that approaches its target under
+  /// acceleration and jerk limits. A limit of zero or less disables it.
+  class ShapedReference {
+
+    public:
+      ShapedReference() : velocity_(0.0), acceleration_(0.0), max_acceleration_(0.0), max_jerk_(0.0) {}
+
+      void setLimits(double max_acceleration, double max_jerk)
+      {
+        max_acceleration_ = max_acceleration;
+        max_jerk_ = max_jerk;
+      }
+
+      void reset(double velocity)
+      {
+        velocity_ = velocity;
+        acceleration_ = 0.0;
+      }
+
+      /// \brief Step towards target.
+      /// \return Acceleration applied over this step.
+      double update(double target, double dt)
+      {
+        const double error = target - velocity_;
+        double acceleration = error / dt;
+        if (max_acceleration_ > 0.0)
+          acceleration = clamp(acceleration, max_acceleration_);
+        if (max_jerk_ > 0.0) {
+          // Cap the acceleration so that it can still be ramped back to zero
+          // by the time the target is reached, then ramp towards it.
+          acceleration = clamp(acceleration, std::sqrt(2.0 * max_jerk_ * std::abs(error)));
+          acceleration = acceleration_ + clamp(acceleration - acceleration_, max_jerk_ * dt);
+        }
+
+        velocity_ += acceleration * dt;
+        if ((error >= 0.0) != (target - velocity_ >= 0.0)) {
+          acceleration = error / dt;
+          velocity_ = target;
+        }
+        acceleration_ = acceleration;
+        return acceleration;
+      }
+
+      double velocity() const { return velocity_; }
+
+    private:
+      static double clamp(double value, double limit)
+      {
+        return std::max(-limit, std::min(limit, value));
+      }
+
+      double velocity_;
+      double acceleration_;
+      double max_acceleration_;
+      double max_jerk_;
+  };
+
+  /// \brief Planar body-velocity controller for the force based move plugins.
+  ///
+  /// Commands are shaped into a reference, which is tracked with
+  /// feed-forward force m * (a_ref + w x v) plus feedback m * k * (v_ref - v).
+  /// The first term includes the rotating-frame term, so holding a body
+  /// velocity while turning needs no error. Feedback is expressed as a
+  /// bandwidth k in 1/s, so the loop stays the same across robot masses.
+  ///
+  /// One explicit step of the closed loop scales the error by (1 - k dt).
+  /// That diverges for k dt > 2 and rings for k dt > 1, which is what the
+  /// fixed P gains do once the physics step grows. Each bandwidth is
+  /// therefore capped at stability_margin / dt.
+  class FeedForwardController {
+
+    public:
+      struct Parameters {
+        Parameters()
+          : mass(1.0), yaw_inertia(1.0), linear_bandwidth(20.0), angular_bandwidth(20.0),
+            max_linear_acceleration(0.0), max_angular_acceleration(0.0),
+            max_linear_jerk(0.0), max_angular_jerk(0.0), stability_margin(0.5) {}
+
+        double mass;
+        double yaw_inertia;
+        double linear_bandwidth;
+        double angular_bandwidth;
+        double max_linear_acceleration;
+        double max_angular_acceleration;
+        double max_linear_jerk;
+        double max_angular_jerk;
+        double stability_margin;
+      };
+
+      FeedForwardController() : last_dt_(0.0), linear_gain_(0.0), angular_gain_(0.0) {}
+
+      void configure(const Parameters& parameters)
+      {
+        parameters_ = parameters;
+        x_.setLimits(parameters.max_linear_acceleration, parameters.max_linear_jerk);
+        y_.setLimits(parameters.max_linear_acceleration, parameters.max_linear_jerk);
+        yaw_.setLimits(parameters.max_angular_acceleration, parameters.max_angular_jerk);
+        last_dt_ = 0.0;
+      }
+
+      /// \brief Start the references at the measured velocity.
+      void reset(double linear_x, double linear_y, double angular_z)
+      {
+        x_.reset(linear_x);
+        y_.reset(linear_y);
+        yaw_.reset(angular_z);
+      }
+
+      /// \brief Body-frame force and yaw torque for one physics step.
+      void update(double cmd_x, double cmd_y, double cmd_rot,
+                  double linear_x, double linear_y, double angular_z, double dt,
+                  double& force_x, double& force_y, double& torque_z)
+      {
+        if (dt != last_dt_)
+          schedule(dt);
+
+        const double accel_x = x_.update(cmd_x, dt);
+        const double accel_y = y_.update(cmd_y, dt);
+        const double accel_yaw = yaw_.update(cmd_rot, dt);
+
+        force_x = parameters_.mass *
+          (accel_x - angular_z * linear_y + linear_gain_ * (x_.velocity() - linear_x));
+        force_y = parameters_.mass *
+          (accel_y + angular_z * linear_x + linear_gain_ * (y_.velocity() - linear_y));
+        torque_z = parameters_.yaw_inertia *
+          (accel_yaw + angular_gain_ * (yaw_.velocity() - angular_z));
+      }
+
+      /// \brief Bandwidths in use after the stability cap, in 1/s.
+      double linearGain() const { return linear_gain_; }
+      double angularGain() const { return angular_gain_; }
+
+    private:
+      void schedule(double dt)
+      {
+        const double cap = dt > 0.0 ? parameters_.stability_margin / dt : parameters_.linear_bandwidth;
+        linear_gain_ = std::min(parameters_.linear_bandwidth, cap);
+        angular_gain_ = std::min(parameters_.angular_bandwidth, cap);
+        last_dt_ = dt;
+      }
+
+      Parameters parameters_;
+      ShapedReference x_;
+      ShapedReference y_;
+      ShapedReference yaw_;
+      double last_dt_;
+      double linear_gain_;
+      double angular_gain_;
+  };
+
+  /// \brief Read the optional feed-forward controller elements of a plugin.
+  /// Mass and yaw inertia are left for the caller to fill in.
+  inline FeedForwardController::Parameters feedForwardParameters(const sdf::ElementPtr& sdf)
+  {
+    FeedForwardController::Parameters parameters;
+    if (sdf->HasElement("linearBandwidth"))
+      parameters.linear_bandwidth = sdf->GetElement("linearBandwidth")->Get<double>();
+    if (sdf->HasElement("angularBandwidth"))
+      parameters.angular_bandwidth = sdf->GetElement("angularBandwidth")->Get<double>();
+    if (sdf->HasElement("maxLinearAcceleration"))
+      parameters.max_linear_acceleration = sdf->GetElement("maxLinearAcceleration")->Get<double>();
+    if (sdf->HasElement("maxAngularAcceleration"))
+      parameters.max_angular_acceleration = sdf->GetElement("maxAngularAcceleration")->Get<double>();
+    if (sdf->HasElement("maxLinearJerk"))
+      parameters.max_linear_jerk = sdf->GetElement("maxLinearJerk")->Get<double>();
+    if (sdf->HasElement("maxAngularJerk"))
+      parameters.max_angular_jerk = sdf->GetElement("maxAngularJerk")->Get<double>();
+    if (sdf->HasElement("stabilityMargin"))
+      parameters.stability_margin = sdf->GetElement("stabilityMargin")->Get<double>();
+    return parameters;
+  }
+
+  /// \brief Total mass of a model and its yaw inertia about the CoG of
+  /// base, from the inertials of all its links (parallel axis theorem).
+  inline void modelInertia(const physics::ModelPtr& model, const physics::LinkPtr& base,
+                           double& mass, double& yaw_inertia)
+  {
+    mass = 0.0;
+    yaw_inertia = 0.0;
+    const ignition::math::Pose3d base_pose = base->WorldCoGPose();
+    const physics::Link_V& links = model->GetLinks();
+    for (physics::Link_V::const_iterator it = links.begin(); it != links.end(); ++it) {
+      const physics::InertialPtr inertial = (*it)->GetInertial();
+      if (!inertial)
+        continue;
+      const ignition::math::Vector3d offset =
+        base_pose.Rot().RotateVectorReverse((*it)->WorldCoGPose().Pos() - base_pose.Pos());
+      mass += inertial->Mass();
+      yaw_inertia += inertial->IZZ() + inertial->Mass() * (offset.X() * offset.X() + offset.Y() * offset.Y());
+    }
+  }
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_FEED_FORWARD_CONTROLLER_H */
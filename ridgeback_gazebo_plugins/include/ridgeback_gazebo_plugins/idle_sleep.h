@@ -0,0 +1,174 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Sleep state of an idle base, and the process-wide count of
+ *       sleeping robots.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_IDLE_SLEEP_H
+#define RIDGEBACK_GAZEBO_PLUGINS_IDLE_SLEEP_H
+
+#include <atomic>
+#include <cmath>
+
+#include <sdf/sdf.hh>
+
+namespace gazebo {
+
+  /// \brief Decides when a parked base may stop being controlled.
+  ///
+  /// A base that has had no command and moved slower than the thresholds
+  /// for delay seconds of sim time falls asleep: the plugin zeroes its
+  /// velocities, disables its bodies and stops applying forces. It wakes on
+  /// the next non-zero command, or when ODE re-enables the bodies because an
+  /// enabled body touched them. Only the update thread may call update(),
+  /// sleep() and wake().
+  class IdleSleep {
+
+    public:
+      struct Parameters {
+        Parameters() : enabled(false), linear_threshold(0.01), angular_threshold(0.01), delay(0.5) {}
+
+        bool enabled;
+        /// \brief m/s
+        double linear_threshold;
+        /// \brief rad/s
+        double angular_threshold;
+        /// \brief Sim seconds at rest before falling asleep.
+        double delay;
+      };
+
+      /// \brief <sleepWhenIdle>, <sleepLinearThreshold>, <sleepAngularThreshold>
+      /// and <sleepDelay>.
+      static Parameters parameters(const sdf::ElementPtr& sdf)
+      {
+        Parameters parameters;
+        if (sdf->HasElement("sleepWhenIdle"))
+          parameters.enabled = sdf->GetElement("sleepWhenIdle")->Get<bool>();
+        if (sdf->HasElement("sleepLinearThreshold"))
+          parameters.linear_threshold = sdf->GetElement("sleepLinearThreshold")->Get<double>();
+        if (sdf->HasElement("sleepAngularThreshold"))
+          parameters.angular_threshold = sdf->GetElement("sleepAngularThreshold")->Get<double>();
+        if (sdf->HasElement("sleepDelay"))
+          parameters.delay = sdf->GetElement("sleepDelay")->Get<double>();
+        return parameters;
+      }
+
+      IdleSleep() : asleep_(false), idle_time_(0.0), counted_(false) {}
+
+      // Copies count as robots of their own, so the vectors of the fleet
+      // plugin keep the totals right.
+      IdleSleep(const IdleSleep& other) : asleep_(false), idle_time_(0.0), counted_(false)
+      {
+        *this = other;
+      }
+
+      IdleSleep& operator=(const IdleSleep& other)
+      {
+        if (this != &other) {
+          configure(other.parameters_);
+          if (other.asleep_)
+            sleep();
+          idle_time_ = other.idle_time_;
+        }
+        return *this;
+      }
+
+      ~IdleSleep()
+      {
+        wake();
+        count(false);
+      }
+
+      void configure(const Parameters& parameters)
+      {
+        parameters_ = parameters;
+        count(parameters_.enabled);
+        wake();
+      }
+
+      bool enabled() const { return parameters_.enabled; }
+      bool asleep() const { return asleep_; }
+
+      /// \brief Account for one step of an awake base.
+      /// \return Whether the base should be put to sleep now.
+      bool update(bool commanded, double linear_speed, double angular_speed, double step_time)
+      {
+        if (!parameters_.enabled || commanded ||
+            std::abs(linear_speed) > parameters_.linear_threshold ||
+            std::abs(angular_speed) > parameters_.angular_threshold) {
+          idle_time_ = 0.0;
+          return false;
+        }
+        idle_time_ += step_time;
+        return idle_time_ >= parameters_.delay;
+      }
+
+      void sleep()
+      {
+        if (!asleep_)
+          sleeping().fetch_add(1, std::memory_order_relaxed);
+        asleep_ = true;
+      }
+
+      void wake()
+      {
+        if (asleep_)
+          sleeping().fetch_sub(1, std::memory_order_relaxed);
+        asleep_ = false;
+        idle_time_ = 0.0;
+      }
+
+      /// \brief Robots in this process with sleep enabled, and how many of
+      /// them are asleep. Safe to read from any thread.
+      static unsigned int sleepingRobots() { return sleeping().load(std::memory_order_relaxed); }
+      static unsigned int activeRobots()
+      {
+        return robots().load(std::memory_order_relaxed) - sleeping().load(std::memory_order_relaxed);
+      }
+
+    private:
+      void count(bool counted)
+      {
+        if (counted && !counted_)
+          robots().fetch_add(1, std::memory_order_relaxed);
+        else if (!counted && counted_)
+          robots().fetch_sub(1, std::memory_order_relaxed);
+        counted_ = counted;
+      }
+
+      static std::atomic<unsigned int>& robots()
+      {
+        static std::atomic<unsigned int> count(0);
+        return count;
+      }
+
+      static std::atomic<unsigned int>& sleeping()
+      {
+        static std::atomic<unsigned int> count(0);
+        return count;
+      }
+
+      Parameters parameters_;
+      bool asleep_;
+      double idle_time_;
+      bool counted_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_IDLE_SLEEP_H */
@@ -0,0 +1,93 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Fixed set of preallocated messages for zero-copy publishing.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_MESSAGE_POOL_H
+#define RIDGEBACK_GAZEBO_PLUGINS_MESSAGE_POOL_H
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+namespace gazebo {
+
+  /// \brief Recycles messages published by shared pointer.
+  ///
+  /// roscpp hands a published boost::shared_ptr straight to subscribers in
+  /// the same process (nodelets, other plugins) and only serializes it
+  /// for remote ones. Such a message must not change once published, so a
+  /// slot is only reused when the pool holds its last reference, i.e.
+  /// every subscriber queue has let go of it. If all slots are still in
+  /// flight, the oldest slot is replaced by a fresh copy of the prototype
+  /// and the in-flight message is freed by whoever drops it last.
+  ///
+  /// Fields that never change (frame ids, fixed covariances) only need to
+  /// be set on the prototype. Only one thread may call acquire().
+  template <class M>
+  class MessagePool {
+
+    public:
+      typedef boost::shared_ptr<M> Ptr;
+
+      MessagePool(size_t size, const M& prototype)
+        : prototype_(prototype), next_(0), exhausted_(0)
+      {
+        if (size == 0)
+          size = 1;
+        slots_.reserve(size);
+        for (size_t i = 0; i < size; ++i)
+          slots_.push_back(Ptr(new M(prototype)));
+      }
+
+      /// \brief A message nobody else references, ready to be filled in.
+      Ptr acquire()
+      {
+        const size_t size = slots_.size();
+        for (size_t i = 0; i < size; ++i) {
+          const size_t index = (next_ + i) % size;
+          if (slots_[index].use_count() == 1) {
+            // Order the subscribers' last reads before our writes.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            next_ = (index + 1) % size;
+            return slots_[index];
+          }
+        }
+
+        exhausted_.fetch_add(1, std::memory_order_relaxed);
+        Ptr& slot = slots_[next_];
+        slot.reset(new M(prototype_));
+        next_ = (next_ + 1) % size;
+        return slot;
+      }
+
+      /// \brief Times every slot was in flight, safe to read from any thread.
+      uint64_t exhausted() const { return exhausted_.load(std::memory_order_relaxed); }
+
+    private:
+      M prototype_;
+      std::vector<Ptr> slots_;
+      size_t next_;
+      std::atomic<uint64_t> exhausted_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_MESSAGE_POOL_H */
@@ -0,0 +1,147 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: In-memory snapshot of a model's link states, and the handoff that
+ *       runs snapshot service requests on the physics thread.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_MODEL_SNAPSHOT_H
+#define RIDGEBACK_GAZEBO_PLUGINS_MODEL_SNAPSHOT_H
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <atomic>
+#include <vector>
+
+#include <gazebo/physics/physics.hh>
+#include <ros/ros.h>
+
+namespace gazebo {
+
+  /// \brief World pose and velocity of every link of a model.
+  ///
+  /// Restoring sets the links directly instead of going through the joints,
+  /// which is what puts a wheeled model back exactly, wheel angles included.
+  class ModelSnapshot {
+
+    public:
+      bool empty() const { return links_.empty(); }
+
+      void capture(const physics::ModelPtr& model)
+      {
+        links_.clear();
+        const physics::Link_V& links = model->GetLinks();
+        links_.reserve(links.size());
+        for (physics::Link_V::const_iterator it = links.begin(); it != links.end(); ++it) {
+          LinkState state;
+          state.link = *it;
+          state.pose = (*it)->WorldPose();
+          state.linear_vel = (*it)->WorldLinearVel();
+          state.angular_vel = (*it)->WorldAngularVel();
+          links_.push_back(state);
+        }
+      }
+
+      /// \brief Update thread, or any thread holding the physics update
+      /// mutex.
+      void restore(const physics::ModelPtr& model) const
+      {
+        // Drops forces and torques accumulated for the step in progress.
+        model->ResetPhysicsStates();
+        for (std::vector<LinkState>::const_iterator it = links_.begin(); it != links_.end(); ++it) {
+          it->link->SetWorldPose(it->pose);
+          it->link->SetLinearVel(it->linear_vel);
+          it->link->SetAngularVel(it->angular_vel);
+        }
+      }
+
+    private:
+      struct LinkState {
+        physics::LinkPtr link;
+        ignition::math::Pose3d pose;
+        ignition::math::Vector3d linear_vel;
+        ignition::math::Vector3d angular_vel;
+      };
+      std::vector<LinkState> links_;
+  };
+
+  /// \brief Hands snapshot and restore requests from a service callback to
+  /// the physics thread.
+  ///
+  /// The update thread only does an atomic load per step until a request
+  /// is pending. A paused world never runs its update callbacks, so after
+  /// a short wait on a paused world the caller applies the request itself,
+  /// under the physics update mutex in case the world is unpaused or
+  /// stepped meanwhile.
+  class SnapshotHandoff {
+
+    public:
+      enum Action { kNone, kCapture, kRestore };
+
+      SnapshotHandoff() : pending_(kNone), done_(false), result_(false) {}
+
+      /// \brief Service thread. apply(action) returns whether it succeeded.
+      template <typename Apply>
+      bool request(Action action, const physics::WorldPtr& world, Apply apply)
+      {
+        boost::mutex::scoped_lock call_lock(call_mutex_);
+        boost::mutex::scoped_lock lock(mutex_);
+        done_ = false;
+        pending_.store(action, std::memory_order_release);
+        while (!done_ && ros::ok()) {
+          if (!done_cond_.timed_wait(lock, boost::posix_time::milliseconds(100)) && !done_ &&
+              world->IsPaused()) {
+            boost::recursive_mutex::scoped_lock physics_lock(*world->Physics()->GetPhysicsUpdateMutex());
+            finish(apply(action));
+          }
+        }
+        return done_ && result_;
+      }
+
+      /// \brief Update thread, once per step.
+      template <typename Apply>
+      void poll(Apply apply)
+      {
+        if (pending_.load(std::memory_order_acquire) == kNone)
+          return;
+        boost::mutex::scoped_lock lock(mutex_);
+        const Action action = pending_.load(std::memory_order_relaxed);
+        if (action != kNone)
+          finish(apply(action));
+      }
+
+    private:
+      void finish(bool result)
+      {
+        result_ = result;
+        done_ = true;
+        pending_.store(kNone, std::memory_order_relaxed);
+        done_cond_.notify_all();
+      }
+
+      boost::mutex call_mutex_;
+      boost::mutex mutex_;
+      boost::condition_variable done_cond_;
+      std::atomic<Action> pending_;
+      bool done_;
+      bool result_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_MODEL_SNAPSHOT_H */
@@ -0,0 +1,316 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Rasterizes triangulated collision geometry between two heights
+ *       into occupancy grid cells, one tile per work item.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_OCCUPANCY_RASTER_H
+#define RIDGEBACK_GAZEBO_PLUGINS_OCCUPANCY_RASTER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace gazebo {
+
+  /// \brief Occupancy of a horizontal band of the world.
+  ///
+  /// Geometry is given as world frame triangles. Each triangle is clipped
+  /// to the band min_z <= z <= max_z of its solid and projected onto the
+  /// grid. Convex solids are
+  /// filled as the hull of their clipped triangles; other meshes only mark
+  /// the cells their surface passes through, which is what a laser scan
+  /// of them would show too. A cell is occupied if the projection covers
+  /// its centre or an edge of it passes through the cell.
+  ///
+  /// add() bins polygons into square tiles; rasterize() then fills the
+  /// tiles from a pool of threads. Each tile is written by one thread only.
+  class OccupancyRaster {
+
+    public:
+      static const int8_t kFree = 0;
+      static const int8_t kOccupied = 100;
+      static const unsigned int kTileSize = 64;
+
+      struct Vertex {
+        double x, y, z;
+      };
+
+      struct Point {
+        double x, y;
+      };
+
+      typedef std::vector<Point> Polygon;
+
+      OccupancyRaster(double origin_x, double origin_y, double resolution,
+                      unsigned int width, unsigned int height)
+        : origin_x_(origin_x), origin_y_(origin_y), resolution_(resolution),
+          width_(width), height_(height),
+          tiles_x_((width + kTileSize - 1) / kTileSize),
+          tiles_y_((height + kTileSize - 1) / kTileSize),
+          bins_(tiles_x_ * tiles_y_) {}
+
+      /// \param triangles Three vertices per triangle.
+      void addSolid(const std::vector<Vertex>& triangles, bool convex, double min_z, double max_z)
+      {
+        Polygon hull;
+        Polygon clipped;
+        for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+          clipped.clear();
+          clipToBand(&triangles[i], min_z, max_z, &clipped);
+          if (clipped.empty())
+            continue;
+          if (convex)
+            hull.insert(hull.end(), clipped.begin(), clipped.end());
+          else
+            add(clipped);
+        }
+        if (convex && !hull.empty())
+          add(convexHull(hull));
+      }
+
+      void add(const Polygon& polygon)
+      {
+        double min_x = polygon[0].x, max_x = polygon[0].x;
+        double min_y = polygon[0].y, max_y = polygon[0].y;
+        for (size_t i = 1; i < polygon.size(); ++i) {
+          min_x = std::min(min_x, polygon[i].x);
+          max_x = std::max(max_x, polygon[i].x);
+          min_y = std::min(min_y, polygon[i].y);
+          max_y = std::max(max_y, polygon[i].y);
+        }
+        int x0, x1, y0, y1;
+        if (!cellRange(min_x, max_x, width_, origin_x_, &x0, &x1) ||
+            !cellRange(min_y, max_y, height_, origin_y_, &y0, &y1))
+          return;
+
+        const uint32_t index = polygons_.size();
+        polygons_.push_back(polygon);
+        for (int ty = y0 / kTileSize; ty <= y1 / static_cast<int>(kTileSize); ++ty)
+          for (int tx = x0 / kTileSize; tx <= x1 / static_cast<int>(kTileSize); ++tx)
+            bins_[ty * tiles_x_ + tx].push_back(index);
+      }
+
+      size_t polygonCount() const { return polygons_.size(); }
+      size_t tileCount() const { return bins_.size(); }
+
+      /// \brief Fill the grid, row major from the origin.
+      /// \param threads Worker threads, zero for one per core.
+      void rasterize(unsigned int threads, std::vector<int8_t>* data) const
+      {
+        data->assign(static_cast<size_t>(width_) * height_, static_cast<int8_t>(kFree));
+        if (threads == 0)
+          threads = std::max(1u, boost::thread::hardware_concurrency());
+        threads = std::min<size_t>(threads, std::max<size_t>(1, bins_.size()));
+
+        std::atomic<size_t> next_tile(0);
+        boost::thread_group workers;
+        for (unsigned int i = 1; i < threads; ++i)
+          workers.create_thread(boost::bind(&OccupancyRaster::work, this, &next_tile, data));
+        work(&next_tile, data);
+        workers.join_all();
+      }
+
+      /// \brief Part of a triangle inside the band, projected to x and y.
+      ///
+      /// Sutherland-Hodgman against the two band planes. Appends nothing
+      /// if the triangle lies entirely above or below the band.
+      static void clipToBand(const Vertex* triangle, double min_z, double max_z, Polygon* out)
+      {
+        Vertex below[4];
+        Vertex inside[5];
+        const size_t below_count = clip(triangle, 3, min_z, true, below);
+        const size_t inside_count = clip(below, below_count, max_z, false, inside);
+        for (size_t i = 0; i < inside_count; ++i) {
+          Point p = {inside[i].x, inside[i].y};
+          out->push_back(p);
+        }
+      }
+
+      /// \brief Counter-clockwise hull, monotone chain.
+      static Polygon convexHull(Polygon points)
+      {
+        std::sort(points.begin(), points.end(), lessPoint);
+        points.erase(std::unique(points.begin(), points.end(), equalPoint), points.end());
+        if (points.size() < 3)
+          return points;
+
+        Polygon hull(2 * points.size());
+        size_t k = 0;
+        for (size_t i = 0; i < points.size(); ++i) {
+          while (k >= 2 && cross(hull[k - 2], hull[k - 1], points[i]) <= 0.0)
+            --k;
+          hull[k++] = points[i];
+        }
+        for (size_t i = points.size() - 1, lower = k + 1; i > 0; --i) {
+          while (k >= lower && cross(hull[k - 2], hull[k - 1], points[i - 1]) <= 0.0)
+            --k;
+          hull[k++] = points[i - 1];
+        }
+        hull.resize(k - 1);
+        return hull;
+      }
+
+    private:
+      /// \brief Clip a convex polygon against z >= limit (keep_above) or z <= limit.
+      static size_t clip(const Vertex* in, size_t count, double limit, bool keep_above, Vertex* out)
+      {
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i) {
+          const Vertex& a = in[i];
+          const Vertex& b = in[(i + 1) % count];
+          const bool a_in = keep_above ? a.z >= limit : a.z <= limit;
+          const bool b_in = keep_above ? b.z >= limit : b.z <= limit;
+          if (a_in)
+            out[n++] = a;
+          if (a_in != b_in) {
+            const double t = (limit - a.z) / (b.z - a.z);
+            Vertex v = {a.x + t * (b.x - a.x), a.y + t * (b.y - a.y), limit};
+            out[n++] = v;
+          }
+        }
+        return n;
+      }
+
+      static bool lessPoint(const Point& a, const Point& b)
+      {
+        return a.x < b.x || (a.x == b.x && a.y < b.y);
+      }
+
+      static bool equalPoint(const Point& a, const Point& b)
+      {
+        return a.x == b.x && a.y == b.y;
+      }
+
+      static double cross(const Point& o, const Point& a, const Point& b)
+      {
+        return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+      }
+
+      /// \brief Cells from min to max along one axis, clamped to the grid.
+      bool cellRange(double min, double max, unsigned int size, double origin, int* first, int* last) const
+      {
+        const double lo = std::floor((min - origin) / resolution_);
+        const double hi = std::floor((max - origin) / resolution_);
+        if (hi < 0.0 || lo >= size)
+          return false;
+        *first = static_cast<int>(std::max(lo, 0.0));
+        *last = static_cast<int>(std::min(hi, size - 1.0));
+        return true;
+      }
+
+      void work(std::atomic<size_t>* next_tile, std::vector<int8_t>* data) const
+      {
+        for (size_t tile = next_tile->fetch_add(1); tile < bins_.size(); tile = next_tile->fetch_add(1)) {
+          const int x0 = (tile % tiles_x_) * kTileSize;
+          const int y0 = (tile / tiles_x_) * kTileSize;
+          const int x1 = std::min<int>(x0 + kTileSize, width_) - 1;
+          const int y1 = std::min<int>(y0 + kTileSize, height_) - 1;
+          for (size_t i = 0; i < bins_[tile].size(); ++i)
+            fill(polygons_[bins_[tile][i]], x0, x1, y0, y1, data);
+        }
+      }
+
+      /// \brief Rasterize one polygon into the cells x0..x1, y0..y1.
+      void fill(const Polygon& polygon, int x0, int x1, int y0, int y1, std::vector<int8_t>* data) const
+      {
+        // Edges first, so slivers such as vertical walls still show up.
+        const double step = 0.5 * resolution_;
+        for (size_t i = 0; i < polygon.size(); ++i) {
+          const Point& a = polygon[i];
+          const Point& b = polygon[(i + 1) % polygon.size()];
+          const double length = std::hypot(b.x - a.x, b.y - a.y);
+          const int samples = static_cast<int>(std::ceil(length / step));
+          for (int s = 0; s <= samples; ++s) {
+            const double t = samples > 0 ? static_cast<double>(s) / samples : 0.0;
+            mark(a.x + t * (b.x - a.x), a.y + t * (b.y - a.y), x0, x1, y0, y1, data);
+          }
+        }
+        if (polygon.size() < 3)
+          return;
+
+        double min_x = polygon[0].x, max_x = polygon[0].x;
+        double min_y = polygon[0].y, max_y = polygon[0].y;
+        for (size_t i = 1; i < polygon.size(); ++i) {
+          min_x = std::min(min_x, polygon[i].x);
+          max_x = std::max(max_x, polygon[i].x);
+          min_y = std::min(min_y, polygon[i].y);
+          max_y = std::max(max_y, polygon[i].y);
+        }
+        int cx0, cx1, cy0, cy1;
+        if (!cellRange(min_x, max_x, width_, origin_x_, &cx0, &cx1) ||
+            !cellRange(min_y, max_y, height_, origin_y_, &cy0, &cy1))
+          return;
+        cx0 = std::max(cx0, x0);
+        cx1 = std::min(cx1, x1);
+        cy0 = std::max(cy0, y0);
+        cy1 = std::min(cy1, y1);
+        for (int y = cy0; y <= cy1; ++y) {
+          const double py = origin_y_ + (y + 0.5) * resolution_;
+          for (int x = cx0; x <= cx1; ++x) {
+            const double px = origin_x_ + (x + 0.5) * resolution_;
+            if (containsPoint(polygon, px, py))
+              (*data)[static_cast<size_t>(y) * width_ + x] = kOccupied;
+          }
+        }
+      }
+
+      void mark(double px, double py, int x0, int x1, int y0, int y1, std::vector<int8_t>* data) const
+      {
+        const double fx = std::floor((px - origin_x_) / resolution_);
+        const double fy = std::floor((py - origin_y_) / resolution_);
+        if (fx < x0 || fx > x1 || fy < y0 || fy > y1)
+          return;
+        (*data)[static_cast<size_t>(fy) * width_ + static_cast<size_t>(fx)] = kOccupied;
+      }
+
+      /// \brief Even-odd crossing test.
+      static bool containsPoint(const Polygon& polygon, double px, double py)
+      {
+        bool inside = false;
+        for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+          const Point& a = polygon[i];
+          const Point& b = polygon[j];
+          if ((a.y > py) != (b.y > py) &&
+              px < a.x + (py - a.y) * (b.x - a.x) / (b.y - a.y))
+            inside = !inside;
+        }
+        return inside;
+      }
+
+      double origin_x_;
+      double origin_y_;
+      double resolution_;
+      unsigned int width_;
+      unsigned int height_;
+      unsigned int tiles_x_;
+      unsigned int tiles_y_;
+
+      std::vector<Polygon> polygons_;
+      /// \brief Indices into polygons_ of everything overlapping each tile.
+      std::vector<std::vector<uint32_t> > bins_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_OCCUPANCY_RASTER_H */
@@ -0,0 +1,113 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Seeded pose error model for ground-truth odometry.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_ODOMETRY_NOISE_H
+#define RIDGEBACK_GAZEBO_PLUGINS_ODOMETRY_NOISE_H
+
+#include <cmath>
+#include <random>
+#include <stdint.h>
+#include <string>
+
+#include <ridgeback_gazebo_plugins/se2_integrator.h>
+
+namespace gazebo {
+
+  /// \brief Deterministic planar error applied on top of a ground-truth pose.
+  ///
+  /// The error is a random walk (drift, scaled by sqrt(dt) so it does not
+  /// depend on the publish rate) plus white noise drawn fresh every tick.
+  /// The result is a small odom-frame transform to pre-multiply the true
+  /// pose with, so heading drift swings the position about the odom origin
+  /// the way dead-reckoned heading error does. The same seed and the same
+  /// sequence of ticks give the same error sequence.
+  class OdometryNoise {
+
+    public:
+      struct Parameters {
+        Parameters()
+          : position_stddev(0.0), yaw_stddev(0.0), position_drift(0.0), yaw_drift(0.0), seed(0) {}
+
+        /// \brief White noise per tick, in m and rad.
+        double position_stddev;
+        double yaw_stddev;
+        /// \brief Random walk intensity, in m/sqrt(s) and rad/sqrt(s).
+        double position_drift;
+        double yaw_drift;
+        uint32_t seed;
+      };
+
+      OdometryNoise() : enabled_(false) {}
+
+      void configure(const Parameters& parameters)
+      {
+        parameters_ = parameters;
+        enabled_ = parameters.position_stddev > 0.0 || parameters.yaw_stddev > 0.0 ||
+                   parameters.position_drift > 0.0 || parameters.yaw_drift > 0.0;
+        generator_.seed(parameters.seed);
+        normal_.reset();
+        drift_ = Se2Delta();
+      }
+
+      bool enabled() const { return enabled_; }
+      const Parameters& parameters() const { return parameters_; }
+
+      /// \brief Advance the drift by dt and return this tick's error.
+      Se2Delta sample(double dt)
+      {
+        if (!enabled_)
+          return Se2Delta();
+
+        if (dt > 0.0) {
+          const double root_dt = std::sqrt(dt);
+          drift_.x += parameters_.position_drift * root_dt * normal_(generator_);
+          drift_.y += parameters_.position_drift * root_dt * normal_(generator_);
+          drift_.yaw += parameters_.yaw_drift * root_dt * normal_(generator_);
+        }
+
+        return Se2Delta(drift_.x + parameters_.position_stddev * normal_(generator_),
+                        drift_.y + parameters_.position_stddev * normal_(generator_),
+                        drift_.yaw + parameters_.yaw_stddev * normal_(generator_));
+      }
+
+      /// \brief Stable per-robot seed, so robots sharing a base seed still
+      /// get independent error sequences.
+      static uint32_t seedFor(uint32_t seed, const std::string& name)
+      {
+        // FNV-1a, stable across standard libraries unlike std::hash.
+        uint32_t hash = 2166136261u ^ seed;
+        for (std::string::const_iterator it = name.begin(); it != name.end(); ++it) {
+          hash ^= static_cast<unsigned char>(*it);
+          hash *= 16777619u;
+        }
+        return hash;
+      }
+
+    private:
+      Parameters parameters_;
+      bool enabled_;
+      std::mt19937 generator_;
+      std::normal_distribution<double> normal_;
+      Se2Delta drift_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_ODOMETRY_NOISE_H */
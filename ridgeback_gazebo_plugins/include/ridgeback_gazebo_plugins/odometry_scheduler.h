@@ -0,0 +1,150 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Fixed-rate odometry publish scheduler driven by simulation time.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_ODOMETRY_SCHEDULER_H
+#define RIDGEBACK_GAZEBO_PLUGINS_ODOMETRY_SCHEDULER_H
+
+#include <atomic>
+#include <cmath>
+#include <stdint.h>
+
+#include <gazebo/common/Time.hh>
+
+#include <ridgeback_gazebo_plugins/step_clock.h>
+
+namespace gazebo {
+
+  /// \brief Decides on which physics steps odometry is due.
+  ///
+  /// The period is held in integer nanoseconds of sim time and the
+  /// deadline advances by whole periods, so the published rate does not
+  /// drift with the step size and the per-step check is one comparison.
+  /// When several deadlines pass in a single step (a slow step, or a
+  /// period shorter than the step), up to max_batch messages are published,
+  /// one per deadline; the rest are skipped. A max_batch of 1 keeps only
+  /// the latest deadline.
+  ///
+  /// Messages are stamped on the deadline grid. Each one covers the sim
+  /// time since the previous stamp, so odometry integrated across skipped
+  /// deadlines still spans the whole interval. Only the update thread may
+  /// call configure(), setRate() and poll().
+  class OdometryScheduler {
+
+    public:
+      OdometryScheduler()
+        : period_ns_(0), next_deadline_ns_(0), last_stamp_ns_(0), previous_stamp_ns_(0),
+          first_stamp_ns_(0), max_batch_(1), published_(0), skipped_(0) {}
+
+      /// \param rate Publish rate in Hz. Zero or negative disables publishing.
+      /// \param start Sim time the first period starts from.
+      /// \param max_batch Most messages published for one step.
+      void configure(double rate, const common::Time& start, unsigned int max_batch)
+      {
+        period_ns_ = periodFor(rate);
+        max_batch_ = max_batch > 0 ? max_batch : 1;
+        restart(start);
+      }
+
+      /// \brief Change the rate from now on. The next message still covers
+      /// the sim time since the last one; after publishing was disabled,
+      /// the first period starts at now.
+      void setRate(double rate, const common::Time& now)
+      {
+        const bool was_enabled = enabled();
+        period_ns_ = periodFor(rate);
+        if (!was_enabled)
+          restart(now);
+        else
+          next_deadline_ns_ = last_stamp_ns_ + period_ns_;
+      }
+
+      /// \brief Start over from start with the configured rate and batch,
+      /// e.g. after a world reset moved sim time back.
+      void restart(const common::Time& start)
+      {
+        last_stamp_ns_ = toNanoseconds(start);
+        previous_stamp_ns_ = last_stamp_ns_;
+        first_stamp_ns_ = last_stamp_ns_;
+        next_deadline_ns_ = last_stamp_ns_ + period_ns_;
+      }
+
+      bool enabled() const { return period_ns_ > 0; }
+
+      /// \brief Advance to now.
+      /// \return Number of messages to publish in this step, 0 if none.
+      unsigned int poll(const common::Time& now)
+      {
+        const int64_t now_ns = toNanoseconds(now);
+        if (period_ns_ <= 0 || now_ns < next_deadline_ns_)
+          return 0;
+
+        const uint64_t passed = static_cast<uint64_t>((now_ns - next_deadline_ns_) / period_ns_) + 1;
+        const unsigned int count = passed < max_batch_ ? static_cast<unsigned int>(passed) : max_batch_;
+
+        previous_stamp_ns_ = last_stamp_ns_;
+        first_stamp_ns_ = next_deadline_ns_ + static_cast<int64_t>(passed - count) * period_ns_;
+        last_stamp_ns_ = first_stamp_ns_ + static_cast<int64_t>(count - 1) * period_ns_;
+        next_deadline_ns_ += static_cast<int64_t>(passed) * period_ns_;
+
+        published_.fetch_add(count, std::memory_order_relaxed);
+        skipped_.fetch_add(passed - count, std::memory_order_relaxed);
+        return count;
+      }
+
+      /// \brief Stamp of message i of the last poll().
+      common::Time stamp(unsigned int i) const
+      {
+        return fromNanoseconds(first_stamp_ns_ + static_cast<int64_t>(i) * period_ns_);
+      }
+
+      /// \brief Sim seconds covered by message i of the last poll().
+      double stepTime(unsigned int i) const
+      {
+        if (i > 0)
+          return period_ns_ * 1e-9;
+        return (first_stamp_ns_ - previous_stamp_ns_) * 1e-9;
+      }
+
+      /// \brief Totals since configure(), safe to read from any thread.
+      uint64_t published() const { return published_.load(std::memory_order_relaxed); }
+      uint64_t skipped() const { return skipped_.load(std::memory_order_relaxed); }
+
+    private:
+      static int64_t periodFor(double rate)
+      {
+        if (rate <= 0.0)
+          return 0;
+        const int64_t period_ns = static_cast<int64_t>(std::llround(1e9 / rate));
+        return period_ns > 0 ? period_ns : 1;
+      }
+
+      int64_t period_ns_;
+      int64_t next_deadline_ns_;
+      int64_t last_stamp_ns_;
+      int64_t previous_stamp_ns_;
+      int64_t first_stamp_ns_;
+      unsigned int max_batch_;
+      std::atomic<uint64_t> published_;
+      std::atomic<uint64_t> skipped_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_ODOMETRY_SCHEDULER_H */
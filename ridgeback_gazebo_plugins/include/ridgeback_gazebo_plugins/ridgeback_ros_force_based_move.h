@@ -27,24 +27,65 @@
 #define GAZEBO_ROS_FORCE_BASED_MOVE_HH
 
 #include <boost/bind.hpp>
+#include <boost/interprocess/sync/interprocess_semaphore.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
+#include <atomic>
 #include <map>
 
 #include <gazebo/common/common.hh>
 #include <gazebo/physics/physics.hh>
 #include <sdf/sdf.hh>
 
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <dynamic_reconfigure/server.h>
+#include <gazebo_step_profiler/step_profiler.h>
+#include <geometry_msgs/TransformStamped.h>
 #include <geometry_msgs/Twist.h>
 #include <nav_msgs/OccupancyGrid.h>
 #include <nav_msgs/Odometry.h>
 #include <ros/advertise_options.h>
 #include <ros/callback_queue.h>
 #include <ros/ros.h>
-#include <tf/transform_broadcaster.h>
-#include <tf/transform_listener.h>
+#include <std_srvs/Trigger.h>
+#include <tf2/LinearMath/Transform.h>
+#include <tf2_ros/transform_broadcaster.h>
+
+#include <ridgeback_gazebo_plugins/allocation_counter.h>
+#include <ridgeback_gazebo_plugins/callback_dispatcher.h>
+#include <ridgeback_gazebo_plugins/command_input.h>
+#include <ridgeback_gazebo_plugins/command_mailbox.h>
+#include <ridgeback_gazebo_plugins/ForceBasedMoveConfig.h>
+#include <ridgeback_gazebo_plugins/feed_forward_controller.h>
+#include <ridgeback_gazebo_plugins/idle_sleep.h>
+#include <ridgeback_gazebo_plugins/message_pool.h>
+#include <ridgeback_gazebo_plugins/model_snapshot.h>
+#include <ridgeback_gazebo_plugins/odometry_noise.h>
+#include <ridgeback_gazebo_plugins/odometry_scheduler.h>
+#include <ridgeback_gazebo_plugins/se2_integrator.h>
+#include <ridgeback_gazebo_plugins/step_clock.h>
+#include <ridgeback_gazebo_plugins/step_log.h>
+#include <ridgeback_gazebo_plugins/tf_batcher.h>
+#include <ridgeback_gazebo_plugins/velocity_trajectory.h>
 
 namespace gazebo {
 
+  /// \brief Drives a model from cmd_vel and publishes its odometry.
+  ///
+  /// Thread safety: Gazebo calls the WorldUpdateBegin handlers of all
+  /// models one after another on the world thread, also with island
+  /// threads, which only parallelize ODE's solver after the handlers ran.
+  /// UpdateChild() therefore needs no locks against other instances. The
+  /// process-wide objects are TfBatcher and CallbackDispatcher, which lock
+  /// internally, and the IdleSleep robot counters, which are atomic.
+  /// ros::Publisher::publish() and tf2_ros::TransformBroadcaster::
+  /// sendTransform() are thread-safe in roscpp, so per-instance publishers
+  /// and broadcasters need no locking either. Within one instance, the
+  /// update thread, the ROS callback thread and the async odometry thread
+  /// only share state through CommandMailbox (or lock), TrajectoryMailbox,
+  /// StepClock, SnapshotHandoff, pending_config_ under reconfigure_mutex_
+  /// with config_pending_, and the sample queue.
   class GazeboRosForceBasedMove : public ModelPlugin {
 
     public:
@@ -52,16 +93,60 @@ namespace gazebo {
       ~GazeboRosForceBasedMove();
       void Load(physics::ModelPtr parent, sdf::ElementPtr sdf);
 
+      /// \brief World reset: back to the state right after Load().
+      virtual void Reset();
+
     protected:
       virtual void UpdateChild();
-      virtual void FiniChild();
 
     private:
-      void publishOdometry(double step_time);
+      /// \brief State captured on the update thread for one odometry message.
+      struct OdometrySample {
+        ros::Time stamp;
+        /// \brief Odometry pose, integrated on the update thread.
+        tf2::Transform transform;
+        double linear_x;
+        double linear_y;
+        double angular_z;
+      };
+      typedef boost::lockfree::spsc_queue<OdometrySample> OdometrySampleQueue;
 
-      tf::Transform getTransformForMotion(double linear_vel_x, double linear_vel_y, double angular_vel, double timeSeconds) const;
+      // Per-step work, instantiated for every combination of the features
+      // below and picked through member function pointers once the SDF is
+      // read, so UpdateChild() does not test disabled features every step.
+      enum ControlPolicy { kVelocityControl, kFeedForwardControl, kKinematicControl };
+      enum TfPolicy { kNoTf, kBatchedTf, kBroadcastTf };
+      enum OdometrySource { kExactOdometry, kFirstOrderOdometry, kAccumulatedOdometry, kGroundTruthOdometry };
+      enum StepLogMode { kStepLogOff, kStepLogRecord, kStepLogReplay };
+      template <bool kLockFree, bool kProfiling, StepLogMode StepLog>
+      void updateStep();
+      template <ControlPolicy Control, bool kPerStepOdometry, bool kSleep>
+      void controlStep(bool commanded, double step_size);
+      template <bool kAsync, OdometrySource Source, bool kStepLog>
+      void odometryStep(const common::Time& sim_time);
+      void noOdometryStep(const common::Time& sim_time);
+      template <OdometrySource Source>
+      OdometrySample sampleOdometry(double step_time, const ros::Time& stamp, bool last_of_step);
+      template <TfPolicy Tf, bool kPooled, bool kProfiling>
+      void publishOdometry(const OdometrySample& sample);
+      /// \brief Pick update_step_, control_step_ and odometry_step_; update
+      /// thread only once UpdateChild() is connected.
+      void selectSteps();
+      typedef void (GazeboRosForceBasedMove::*UpdateStep)();
+      typedef void (GazeboRosForceBasedMove::*ControlStep)(bool commanded, double step_size);
+      typedef void (GazeboRosForceBasedMove::*OdometryStep)(const common::Time& sim_time);
+      typedef void (GazeboRosForceBasedMove::*PublishOdometry)(const OdometrySample& sample);
+      UpdateStep update_step_;
+      ControlStep control_step_;
+      OdometryStep odometry_step_;
+      PublishOdometry publish_odometry_;
+
+      tf2::Transform getTransformForMotion(const Se2Delta& motion) const;
 
       physics::ModelPtr parent_;
+      physics::WorldPtr world_;
+      /// \brief Sim time of the current step, for the ROS callbacks.
+      StepClock step_clock_;
       event::ConnectionPtr update_connection_;
 
       /// \brief A pointer to the Link, where force is applied
@@ -73,16 +158,30 @@ namespace gazebo {
       boost::shared_ptr<ros::NodeHandle> rosnode_;
       ros::Publisher odometry_pub_;
       ros::Subscriber vel_sub_;
-      boost::shared_ptr<tf::TransformBroadcaster> transform_broadcaster_;
+      boost::shared_ptr<tf2_ros::TransformBroadcaster> transform_broadcaster_;
+      /// \brief Set instead of transform_broadcaster_ when <batchTf> is on.
+      boost::shared_ptr<TfBatcher> tf_batcher_;
       nav_msgs::Odometry odom_;
+      /// \brief Set with <zeroCopyOdometry>; odometry is then published by
+      /// shared pointer so subscribers in this process skip serialization.
+      typedef MessagePool<nav_msgs::Odometry> OdometryPool;
+      boost::scoped_ptr<OdometryPool> odometry_pool_;
+      geometry_msgs::TransformStamped odom_stamped_transform_;
       std::string tf_prefix_;
 
-      tf::Transform odom_transform_;
+      /// \brief Update thread only; publishOdometry() gets a copy in the sample.
+      tf2::Transform odom_transform_;
 
       boost::mutex lock;
 
+      /// \brief Hand commands to UpdateChild through command_mailbox_
+      /// instead of taking lock on every physics iteration.
+      bool lock_free_commands_;
+      CommandMailbox command_mailbox_;
+
       std::string robot_namespace_;
       std::string command_topic_;
+      std::string command_trajectory_topic_;
       std::string odometry_topic_;
       std::string odometry_frame_;
       std::string robot_base_frame_;
@@ -93,23 +192,149 @@ namespace gazebo {
       // Custom Callback Queue
       ros::CallbackQueue queue_;
       boost::thread callback_queue_thread_;
+      uint64_t queue_wakeups_;
       void QueueThread();
 
+      /// \brief Set when callbacks are serviced by the process-wide
+      /// dispatcher instead of callback_queue_thread_.
+      boost::shared_ptr<CallbackDispatcher> callback_dispatcher_;
+
+      // Asynchronous odometry publishing. UpdateChild only pushes samples;
+      // odometry_publisher_thread_ builds and sends the messages.
+      bool async_publish_;
+      boost::scoped_ptr<OdometrySampleQueue> odometry_samples_;
+      boost::scoped_ptr<boost::interprocess::interprocess_semaphore> odometry_samples_available_;
+      boost::thread odometry_publisher_thread_;
+      std::atomic<uint64_t> async_published_samples_;
+      std::atomic<uint64_t> async_dropped_samples_;
+      std::atomic<uint64_t> async_max_queue_depth_;
+      void OdometryPublisherThread();
+
+      // Per-step instrumentation, only collected when <diagnosticsRate> is
+      // positive and the plugin was built with ENABLE_PROFILING.
+      bool profiling_;
+      StepHistogram update_histogram_;
+      StepHistogram odometry_histogram_;
+      StepHistogram cmd_vel_histogram_;
+      StepHistogram mutex_wait_histogram_;
+      StepHistogram command_latency_histogram_;
+      std::atomic<uint64_t> last_cmd_received_ns_;
+      bool new_command_;
+      ros::Publisher diagnostics_pub_;
+      ros::WallTimer diagnostics_timer_;
+      void publishDiagnostics(const ros::WallTimerEvent& event);
+
       // command velocity callback
       void cmdVelCallback(const geometry_msgs::Twist::ConstPtr& cmd_msg);
+      /// \brief <maxCommandRate> and the coalesced/dropped counters.
+      CommandInputStage command_input_;
       common::Time last_cmd_vel_time_;
 
+      // velocity trajectory callback, interpolated by UpdateChild
+      void trajectoryCallback(const trajectory_msgs::MultiDOFJointTrajectory::ConstPtr& trajectory_msg);
+      ros::Subscriber trajectory_sub_;
+      TrajectoryMailbox trajectory_mailbox_;
+      VelocityTrajectory trajectory_;
+
       double x_;
       double y_;
       double rot_;
-      bool alive_;
-      common::Time last_odom_publish_time_;
-      ignition::math::Pose3d last_odom_pose_;
+      /// \brief Read by the callback and odometry publisher threads.
+      std::atomic<bool> alive_;
+      OdometryScheduler odometry_scheduler_;
+
+      /// \brief Integrate with the first-order model instead of the exact
+      /// exponential map.
+      bool first_order_odometry_;
+      /// \brief Integrate every physics step into odometry_accumulator_
+      /// and only publish at <odometryRate>.
+      bool per_step_odometry_;
+      /// \brief GetMaxStepSize() at Load(), for a step StepClock could not
+      /// measure.
+      double physics_step_size_;
+      Se2Accumulator odometry_accumulator_;
+
+      /// \brief Publish the model pose relative to spawn_pose_, corrupted
+      /// by odometry_noise_, instead of integrating velocities.
+      bool ground_truth_odometry_;
+      ignition::math::Pose3d spawn_pose_;
+      OdometryNoise odometry_noise_;
 
       double torque_yaw_velocity_p_gain_;
       double force_x_velocity_p_gain_;
       double force_y_velocity_p_gain_;
 
+      /// \brief <mode>kinematic</mode>: set the model velocity from the
+      /// command every step instead of applying forces.
+      bool kinematic_;
+      /// \brief Wheel collisions and gravity are off, height is held.
+      bool kinematic_floating_;
+
+      /// \brief Use controller_ instead of the P gains above.
+      bool feed_forward_control_;
+      FeedForwardController controller_;
+
+      /// \brief Tuning through dynamic_reconfigure. The server callback only
+      /// stores the request; UpdateChild() applies all of it at the start of
+      /// a step, so no step mixes old and new values. The P gains have no
+      /// effect in kinematic or feed-forward mode.
+      typedef dynamic_reconfigure::Server<ridgeback_gazebo_plugins::ForceBasedMoveConfig> ReconfigureServer;
+      boost::recursive_mutex reconfigure_server_mutex_;
+      boost::scoped_ptr<ReconfigureServer> reconfigure_server_;
+      boost::mutex reconfigure_mutex_;
+      ridgeback_gazebo_plugins::ForceBasedMoveConfig pending_config_;
+      std::atomic<bool> config_pending_;
+      void reconfigureCallback(ridgeback_gazebo_plugins::ForceBasedMoveConfig& config, uint32_t level);
+      void applyPendingConfig(const common::Time& sim_time);
+
+      /// \brief <stepLog>: record the command applied and the odometry
+      /// sampled on each step, or replay the commands of a recording and
+      /// check the odometry against it. Update thread only.
+      StepLogMode step_log_mode_;
+      StepLogWriter step_log_writer_;
+      StepLogReader step_log_reader_;
+      size_t replay_command_cursor_;
+      size_t replay_odometry_cursor_;
+      std::atomic<uint64_t> replay_mismatches_;
+      /// \brief Last command recorded, or replayed.
+      double logged_x_;
+      double logged_y_;
+      double logged_rot_;
+      bool command_logged_;
+      void appendStepLog(const StepLogFormat::Record& record);
+      void recordCommand(const common::Time& sim_time);
+      void replayCommand(const common::Time& sim_time);
+      void logOdometry(const OdometrySample& sample);
+      /// \brief Mark a world reset in the recording, or skip the replay to
+      /// the episode after it.
+      void resetStepLog();
+
+      /// \brief <sleepWhenIdle>: disable the bodies of a parked base and
+      /// skip its control until it is commanded or touched.
+      IdleSleep idle_sleep_;
+      void fallAsleep();
+      void wakeUp();
+
+      // Episode snapshots for ~snapshot_state and ~restore_state. Taken and
+      // restored on the update thread through snapshot_handoff_.
+      struct Snapshot {
+        ModelSnapshot model;
+        tf2::Transform odom_transform;
+        Se2Accumulator odometry_accumulator;
+        OdometryNoise odometry_noise;
+        FeedForwardController controller;
+      };
+      bool snapshotCallback(std_srvs::Trigger::Request& request, std_srvs::Trigger::Response& response);
+      bool restoreCallback(std_srvs::Trigger::Request& request, std_srvs::Trigger::Response& response);
+      bool applySnapshotAction(SnapshotHandoff::Action action);
+      /// \brief Drop the current command and any trajectory.
+      void clearCommand();
+      ros::ServiceServer snapshot_srv_;
+      ros::ServiceServer restore_srv_;
+      SnapshotHandoff snapshot_handoff_;
+      Snapshot snapshot_;
+      bool has_snapshot_;
+
   };
 
 }
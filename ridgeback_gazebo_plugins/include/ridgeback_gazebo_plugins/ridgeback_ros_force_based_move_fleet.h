@@ -0,0 +1,218 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: World plugin running the force based move controller for every
+ *       Ridgeback in the world from a single update callback.
+ *
+ *       Models whose name starts with <modelPrefix> are picked up as they
+ *       are spawned. Each one gets <name>/<commandTopic> and
+ *       <name>/<odometryTopic>, and its odometry frames are prefixed with
+ *       the model name. Managed models must not also load the
+ *       libridgeback_ros_force_based_move.so model plugin.
+ *
+ *       The P gains of a robot default to the plugin's, and can be set
+ *       per robot with the <name>/force_based_move/yaw_velocity_p_gain,
+ *       x_velocity_p_gain and y_velocity_p_gain parameters before it is
+ *       spawned. Robot count and update time go to /diagnostics.
+ */
+
+#ifndef GAZEBO_ROS_FORCE_BASED_MOVE_FLEET_HH
+#define GAZEBO_ROS_FORCE_BASED_MOVE_FLEET_HH
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gazebo/common/common.hh>
+#include <gazebo/physics/physics.hh>
+#include <sdf/sdf.hh>
+
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <geometry_msgs/TransformStamped.h>
+#include <geometry_msgs/Twist.h>
+#include <nav_msgs/Odometry.h>
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
+#include <std_srvs/Trigger.h>
+#include <tf2_ros/transform_broadcaster.h>
+
+#include <ridgeback_gazebo_plugins/command_mailbox.h>
+#include <ridgeback_gazebo_plugins/feed_forward_controller.h>
+#include <ridgeback_gazebo_plugins/idle_sleep.h>
+#include <ridgeback_gazebo_plugins/message_pool.h>
+#include <ridgeback_gazebo_plugins/model_snapshot.h>
+#include <ridgeback_gazebo_plugins/odometry_noise.h>
+#include <ridgeback_gazebo_plugins/odometry_scheduler.h>
+#include <ridgeback_gazebo_plugins/se2_integrator.h>
+#include <ridgeback_gazebo_plugins/step_clock.h>
+#include <ridgeback_gazebo_plugins/tf_batcher.h>
+#include <ridgeback_gazebo_plugins/velocity_trajectory.h>
+
+namespace gazebo {
+
+  class GazeboRosForceBasedMoveFleet : public WorldPlugin {
+
+    public:
+      GazeboRosForceBasedMoveFleet();
+      ~GazeboRosForceBasedMoveFleet();
+      void Load(physics::WorldPtr world, sdf::ElementPtr sdf);
+
+      /// \brief World reset: odometry, commands and controllers of every
+      /// managed robot start over.
+      virtual void Reset();
+
+    protected:
+      virtual void UpdateChild();
+
+    private:
+      /// \brief Pick up newly spawned models and forget deleted ones.
+      void refreshRobots();
+      void markModelsChanged();
+      void addRobot(const physics::ModelPtr& model);
+      void removeRobot(size_t index);
+
+      /// \brief <sleepWhenIdle>, see GazeboRosForceBasedMove.
+      void fallAsleep(size_t index);
+      void wakeUp(size_t index);
+
+      void publishOdometry(size_t index, double step_time, const ros::Time& stamp, bool last_of_step);
+
+      void cmdVelCallback(const geometry_msgs::Twist::ConstPtr& cmd_msg,
+                          const boost::shared_ptr<CommandMailbox>& mailbox);
+      void trajectoryCallback(const trajectory_msgs::MultiDOFJointTrajectory::ConstPtr& trajectory_msg,
+                              const boost::shared_ptr<TrajectoryMailbox>& mailbox);
+
+      physics::WorldPtr world_;
+      /// \brief Sim time of the current step, for the ROS callbacks.
+      StepClock step_clock_;
+      event::ConnectionPtr update_connection_;
+      unsigned int known_model_count_;
+      /// \brief Set on addEntity and deleteEntity: a delete and a spawn
+      /// between two steps leave ModelCount() unchanged.
+      std::atomic<bool> models_changed_;
+      event::ConnectionPtr add_entity_connection_;
+      event::ConnectionPtr delete_entity_connection_;
+
+      boost::shared_ptr<ros::NodeHandle> rosnode_;
+      boost::shared_ptr<tf2_ros::TransformBroadcaster> transform_broadcaster_;
+      /// \brief Set instead of transform_broadcaster_ when <batchTf> is on.
+      boost::shared_ptr<TfBatcher> tf_batcher_;
+
+      // Custom Callback Queue
+      ros::CallbackQueue queue_;
+      boost::thread callback_queue_thread_;
+      /// \brief Read by the callback queue thread.
+      std::atomic<bool> alive_;
+      void QueueThread();
+
+      std::string model_prefix_;
+      std::string command_topic_;
+      std::string command_trajectory_topic_;
+      std::string odometry_topic_;
+      std::string odometry_frame_;
+      std::string robot_base_frame_;
+      double odometry_rate_;
+      double cmd_vel_time_out_;
+      bool publish_odometry_tf_;
+      double default_torque_yaw_velocity_p_gain_;
+      double default_force_x_velocity_p_gain_;
+      double default_force_y_velocity_p_gain_;
+      bool kinematic_;
+      bool kinematic_floating_;
+      bool feed_forward_control_;
+      FeedForwardController::Parameters controller_parameters_;
+      OdometryScheduler odometry_scheduler_;
+      bool first_order_odometry_;
+      bool per_step_odometry_;
+      double physics_step_size_;
+      bool ground_truth_odometry_;
+      OdometryNoise::Parameters noise_parameters_;
+      IdleSleep::Parameters sleep_parameters_;
+
+      // Per-robot state, one entry per managed model in every vector.
+      std::vector<physics::ModelPtr> models_;
+      std::vector<physics::LinkPtr> links_;
+      std::vector<boost::shared_ptr<CommandMailbox> > mailboxes_;
+      std::vector<double> cmd_x_;
+      std::vector<double> cmd_y_;
+      std::vector<double> cmd_rot_;
+      std::vector<common::Time> cmd_time_;
+      std::vector<double> torque_yaw_velocity_p_gain_;
+      std::vector<double> force_x_velocity_p_gain_;
+      std::vector<double> force_y_velocity_p_gain_;
+      std::vector<FeedForwardController> controllers_;
+      std::vector<double> odom_x_;
+      std::vector<double> odom_y_;
+      std::vector<double> odom_yaw_;
+      std::vector<Se2Accumulator> odom_accumulators_;
+      std::vector<ignition::math::Pose3d> spawn_poses_;
+      std::vector<OdometryNoise> odom_noises_;
+      std::vector<IdleSleep> idle_sleeps_;
+      std::vector<nav_msgs::Odometry> odom_msgs_;
+      std::vector<geometry_msgs::TransformStamped> odom_transforms_;
+      std::vector<ros::Subscriber> vel_subs_;
+      std::vector<boost::shared_ptr<TrajectoryMailbox> > trajectory_mailboxes_;
+      std::vector<VelocityTrajectory> trajectories_;
+      std::vector<ros::Subscriber> trajectory_subs_;
+      std::vector<ros::Publisher> odometry_pubs_;
+      /// \brief Empty pointers unless <zeroCopyOdometry> is on.
+      typedef MessagePool<nav_msgs::Odometry> OdometryPool;
+      std::vector<boost::shared_ptr<OdometryPool> > odometry_pools_;
+      unsigned int zero_copy_pool_size_;
+
+      // World snapshots for snapshot_state and restore_state: every
+      // non-static model, plus the plugin state of every managed robot.
+      // Taken and restored on the update thread through snapshot_handoff_.
+      struct RobotSnapshot {
+        physics::ModelPtr model;
+        double odom_x;
+        double odom_y;
+        double odom_yaw;
+        Se2Accumulator odom_accumulator;
+        OdometryNoise odom_noise;
+        FeedForwardController controller;
+      };
+      bool snapshotCallback(std_srvs::Trigger::Request& request, std_srvs::Trigger::Response& response);
+      bool restoreCallback(std_srvs::Trigger::Request& request, std_srvs::Trigger::Response& response);
+      bool applySnapshotAction(SnapshotHandoff::Action action);
+      /// \brief Drop the current command and any trajectory of a robot.
+      void clearCommand(size_t index);
+      ros::ServiceServer snapshot_srv_;
+      ros::ServiceServer restore_srv_;
+      SnapshotHandoff snapshot_handoff_;
+      std::vector<std::pair<physics::ModelPtr, ModelSnapshot> > model_snapshots_;
+      std::vector<RobotSnapshot> robot_snapshots_;
+      bool has_snapshot_;
+
+      // Update loop timing, published on /diagnostics every
+      // 1 / <diagnosticsRate> wall seconds.
+      void publishDiagnostics(size_t sleeping, double update_us);
+      ros::Publisher diagnostics_pub_;
+      double diagnostics_period_;
+      ros::WallDuration update_time_;
+      uint64_t update_count_;
+      ros::WallTime last_timing_report_;
+  };
+
+}
+
+#endif /* end of include guard: GAZEBO_ROS_FORCE_BASED_MOVE_FLEET_HH */
@@ -0,0 +1,147 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: World plugin serving an occupancy grid of the world's collision
+ *       geometry, so planners can start from a map without SLAM.
+ *
+ *       get_occupancy_grid rasterizes the band between two heights at a
+ *       given resolution; static_map and the latched map topic serve the
+ *       band and resolution from the SDF, like map_server. Boxes,
+ *       cylinders, spheres and meshes are rasterized; planes, heightmaps
+ *       and polylines are left out, as are models whose name starts with
+ *       <robotPrefix>. Results are cached in <cacheDirectory>, keyed on a
+ *       hash of the world description and of the geometry rasterized.
+ *
+ *       Heights are world z, unless <groundModel> names the terrain: then
+ *       the terrain itself is free space, and every other collision is
+ *       cut at the heights above the terrain directly below it.
+ */
+
+#ifndef GAZEBO_ROS_OCCUPANCY_MAP_HH
+#define GAZEBO_ROS_OCCUPANCY_MAP_HH
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <gazebo/common/common.hh>
+#include <gazebo/physics/physics.hh>
+#include <sdf/sdf.hh>
+
+#include <nav_msgs/GetMap.h>
+#include <nav_msgs/OccupancyGrid.h>
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
+
+#include <ridgeback_gazebo_plugins/GetOccupancyGrid.h>
+#include <ridgeback_gazebo_plugins/occupancy_raster.h>
+
+namespace gazebo {
+
+  class GazeboRosOccupancyMap : public WorldPlugin {
+
+    public:
+      GazeboRosOccupancyMap();
+      ~GazeboRosOccupancyMap();
+      void Load(physics::WorldPtr world, sdf::ElementPtr sdf);
+
+      /// \brief Publish the default map once the world's models are in.
+      virtual void Init();
+
+    private:
+      enum Shape { kBox, kCylinder, kSphere, kMesh };
+
+      /// \brief One collision to rasterize, copied out of the world.
+      struct Geometry {
+        Shape shape;
+        ignition::math::Pose3d pose;
+        /// \brief Box size, cylinder radius and length, sphere radius or
+        /// mesh scale.
+        ignition::math::Vector3d size;
+        const common::Mesh* mesh;
+        std::string uri;
+        /// \brief Part of <groundModel>.
+        bool ground;
+      };
+
+      struct Request {
+        double resolution;
+        double min_height;
+        double max_height;
+      };
+
+      /// \brief Copy the collision geometry out under the physics lock.
+      void collectGeometry(std::vector<Geometry>* geometry);
+      void collectModel(const physics::ModelPtr& model, bool ground, std::vector<Geometry>* geometry);
+
+      uint64_t cacheKey(const std::vector<Geometry>& geometry, const Request& request) const;
+      bool readCache(uint64_t key, nav_msgs::OccupancyGrid* map) const;
+      void writeCache(uint64_t key, const nav_msgs::OccupancyGrid& map) const;
+
+      /// \return false with a reason in message if the map cannot be made.
+      bool buildMap(const Request& request, nav_msgs::OccupancyGrid* map,
+                    bool* cached, std::string* message);
+
+      /// \brief World frame triangles of one collision.
+      static void triangulate(const Geometry& geometry, std::vector<OccupancyRaster::Vertex>* triangles);
+
+      bool getOccupancyGridCallback(ridgeback_gazebo_plugins::GetOccupancyGrid::Request& req,
+                                    ridgeback_gazebo_plugins::GetOccupancyGrid::Response& res);
+      bool staticMapCallback(nav_msgs::GetMap::Request& req, nav_msgs::GetMap::Response& res);
+
+      void publishDefaultMap();
+      void QueueThread();
+
+      physics::WorldPtr world_;
+
+      boost::shared_ptr<ros::NodeHandle> rosnode_;
+      ros::CallbackQueue queue_;
+      boost::thread callback_queue_thread_;
+      /// \brief Read by the callback queue thread.
+      std::atomic<bool> alive_;
+      std::atomic<bool> publish_pending_;
+
+      ros::ServiceServer get_occupancy_grid_srv_;
+      ros::ServiceServer static_map_srv_;
+      ros::Publisher map_pub_;
+
+      std::string frame_id_;
+      std::string robot_prefix_;
+      std::string ground_model_;
+      std::string cache_directory_;
+      Request default_request_;
+      double padding_;
+      unsigned int threads_;
+      uint64_t max_cells_;
+      bool publish_map_;
+      /// \brief Hash of the world description as loaded.
+      uint64_t world_hash_;
+
+      /// \brief Last map built, only touched from the queue thread.
+      uint64_t last_key_;
+      nav_msgs::OccupancyGrid last_map_;
+      bool has_last_map_;
+
+      bool warned_unsupported_;
+  };
+
+}
+
+#endif /* end of include guard: GAZEBO_ROS_OCCUPANCY_MAP_HH */
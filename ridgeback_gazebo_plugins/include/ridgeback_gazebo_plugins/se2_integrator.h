@@ -0,0 +1,133 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Planar odometry integration shared by the force based move plugins.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_SE2_INTEGRATOR_H
+#define RIDGEBACK_GAZEBO_PLUGINS_SE2_INTEGRATOR_H
+
+#include <cmath>
+
+namespace gazebo {
+
+  /// \brief Planar motion expressed in the frame it started from.
+  struct Se2Delta {
+    Se2Delta() : x(0.0), y(0.0), yaw(0.0) {}
+    Se2Delta(double x, double y, double yaw) : x(x), y(y), yaw(yaw) {}
+
+    double x;
+    double y;
+    double yaw;
+  };
+
+  /// \brief Coefficients of the SE(2) exponential map for a turn of theta:
+  /// a = sin(theta) / theta and b = (1 - cos(theta)) / theta.
+  ///
+  /// Near zero both are evaluated from their Taylor series, which are exact
+  /// to double precision below the threshold and stay continuous through
+  /// theta = 0, so there is no special case for driving straight.
+  inline void se2Coefficients(double theta, double& a, double& b)
+  {
+    if (std::abs(theta) < 1e-2) {
+      const double theta2 = theta * theta;
+      a = 1.0 - theta2 / 6.0 * (1.0 - theta2 / 20.0);
+      b = theta / 2.0 * (1.0 - theta2 / 12.0 * (1.0 - theta2 / 30.0));
+    } else {
+      a = std::sin(theta) / theta;
+      b = (1.0 - std::cos(theta)) / theta;
+    }
+  }
+
+  /// \brief Exact motion after holding a constant body twist for dt.
+  inline Se2Delta integrateTwist(double linear_x, double linear_y, double angular_z, double dt)
+  {
+    const double theta = angular_z * dt;
+    double a, b;
+    se2Coefficients(theta, a, b);
+    return Se2Delta((a * linear_x - b * linear_y) * dt,
+                    (b * linear_x + a * linear_y) * dt,
+                    theta);
+  }
+
+  /// \brief The original first-order model, kept for comparison. Below
+  /// 0.0001 rad/s it only moves along x, so lateral motion is lost.
+  inline Se2Delta integrateTwistFirstOrder(double linear_x, double linear_y, double angular_z, double dt)
+  {
+    const double dx = linear_x * dt;
+    const double dy = linear_y * dt;
+    const double angular = angular_z * dt;
+    if (std::abs(angular_z) < 0.0001)
+      return Se2Delta(dx, 0.0, 0.0);
+    return Se2Delta(dx * std::cos(angular) - dy * std::sin(angular),
+                    dx * std::sin(angular) + dy * std::cos(angular),
+                    angular);
+  }
+
+  /// \brief Composes per-step exact increments between odometry messages.
+  ///
+  /// The heading is carried as a cosine/sine pair advanced with the
+  /// identities cos = 1 - theta * b and sin = theta * a, so a step costs a
+  /// few multiplies and no trigonometry while the turn is small.
+  class Se2Accumulator {
+
+    public:
+      Se2Accumulator() { reset(); }
+
+      void add(double linear_x, double linear_y, double angular_z, double dt)
+      {
+        const double theta = angular_z * dt;
+        double a, b;
+        se2Coefficients(theta, a, b);
+        const double dx = (a * linear_x - b * linear_y) * dt;
+        const double dy = (b * linear_x + a * linear_y) * dt;
+
+        delta_.x += cos_ * dx - sin_ * dy;
+        delta_.y += sin_ * dx + cos_ * dy;
+        delta_.yaw += theta;
+
+        const double step_cos = 1.0 - theta * b;
+        const double step_sin = theta * a;
+        const double c = cos_ * step_cos - sin_ * step_sin;
+        sin_ = sin_ * step_cos + cos_ * step_sin;
+        cos_ = c;
+      }
+
+      /// \brief Motion since the last take(), then start over.
+      Se2Delta take()
+      {
+        const Se2Delta delta = delta_;
+        reset();
+        return delta;
+      }
+
+      void reset()
+      {
+        delta_ = Se2Delta();
+        cos_ = 1.0;
+        sin_ = 0.0;
+      }
+
+    private:
+      Se2Delta delta_;
+      double cos_;
+      double sin_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_SE2_INTEGRATOR_H */
@@ -0,0 +1,75 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Sim time of the current physics step, published by the update
+ *       thread for ROS callbacks to stamp with.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_STEP_CLOCK_H
+#define RIDGEBACK_GAZEBO_PLUGINS_STEP_CLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include <gazebo/common/Time.hh>
+
+namespace gazebo {
+
+  inline int64_t toNanoseconds(const common::Time& time)
+  {
+    return static_cast<int64_t>(time.sec) * 1000000000 + time.nsec;
+  }
+
+  inline common::Time fromNanoseconds(int64_t ns)
+  {
+    return common::Time(static_cast<int32_t>(ns / 1000000000), static_cast<int32_t>(ns % 1000000000));
+  }
+
+  /// \brief Snapshot of the world's sim time taken once per step.
+  ///
+  /// Callbacks read this instead of calling World::SimTime() themselves,
+  /// which would touch world state from outside the physics thread. The
+  /// stamp is the start of the step that will pick the command up.
+  class StepClock {
+
+    public:
+      StepClock() : now_ns_(0), step_ns_(0) {}
+
+      /// \brief Update thread only.
+      void set(const common::Time& now)
+      {
+        const int64_t now_ns = toNanoseconds(now);
+        const int64_t previous_ns = now_ns_.load(std::memory_order_relaxed);
+        step_ns_ = now_ns > previous_ns ? now_ns - previous_ns : 0;
+        now_ns_.store(now_ns, std::memory_order_relaxed);
+      }
+
+      common::Time now() const { return fromNanoseconds(nanoseconds()); }
+      int64_t nanoseconds() const { return now_ns_.load(std::memory_order_relaxed); }
+
+      /// \brief Sim time since the previous set(), in seconds, or 0 if it
+      /// did not advance. Update thread only.
+      double stepSize() const { return step_ns_ * 1e-9; }
+
+    private:
+      std::atomic<int64_t> now_ns_;
+      int64_t step_ns_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_STEP_CLOCK_H */
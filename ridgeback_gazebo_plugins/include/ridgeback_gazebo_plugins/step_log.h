@@ -0,0 +1,216 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Memory-mapped binary log of the commands applied and the odometry
+ *       published on each physics step, for deterministic replay.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_STEP_LOG_H
+#define RIDGEBACK_GAZEBO_PLUGINS_STEP_LOG_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+namespace gazebo {
+
+  /// \brief Layout shared by StepLogWriter, StepLogReader and the
+  /// step_log script in ridgeback_gazebo.
+  ///
+  /// A 32 byte header followed by fixed size little-endian records in the
+  /// order they happened. Stamps are sim time in nanoseconds, so a replay
+  /// lines up with the recording step for step regardless of wall clock.
+  struct StepLogFormat {
+    static const uint32_t kMagic = 0x4c534252;  // "RBSL"
+    static const uint32_t kVersion = 1;
+
+    struct Header {
+      uint32_t magic;
+      uint32_t version;
+      /// \brief Physics step size of the recording, seconds.
+      double step_size;
+      uint64_t reserved[2];
+    };
+
+    enum Type {
+      /// \brief values[0..2]: x, y and yaw rate applied from this step on.
+      kCommand = 1,
+      /// \brief values[0..5]: x, y, yaw, linear x, linear y, angular z.
+      kOdometry = 2,
+      /// \brief World reset, sim time starts over after it.
+      kReset = 3
+    };
+
+    struct Record {
+      int64_t stamp_ns;
+      uint32_t type;
+      uint32_t reserved;
+      double values[6];
+    };
+  };
+
+  /// \brief Appends records to a log file through a growing shared mapping.
+  ///
+  /// append() is a copy into the mapping, plus a remap every time the file
+  /// doubles; the kernel writes the pages back in the background. Only one
+  /// thread may use a writer.
+  class StepLogWriter {
+
+    public:
+      StepLogWriter() : fd_(-1), data_(NULL), capacity_(0), size_(0) {}
+      ~StepLogWriter() { close(); }
+
+      bool open(const std::string& path, double step_size)
+      {
+        close();
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0 || !reserve(kInitialCapacity)) {
+          close();
+          return false;
+        }
+        StepLogFormat::Header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = StepLogFormat::kMagic;
+        header.version = StepLogFormat::kVersion;
+        header.step_size = step_size;
+        memcpy(data_, &header, sizeof(header));
+        size_ = sizeof(header);
+        return true;
+      }
+
+      bool isOpen() const { return data_ != NULL; }
+
+      /// \return false once the file cannot grow any further.
+      bool append(const StepLogFormat::Record& record)
+      {
+        if (!data_ || (size_ + sizeof(record) > capacity_ && !reserve(capacity_ * 2)))
+          return false;
+        memcpy(data_ + size_, &record, sizeof(record));
+        size_ += sizeof(record);
+        return true;
+      }
+
+      /// \brief Records appended so far.
+      size_t count() const
+      {
+        return size_ > sizeof(StepLogFormat::Header) ?
+          (size_ - sizeof(StepLogFormat::Header)) / sizeof(StepLogFormat::Record) : 0;
+      }
+
+      /// \brief Unmap and cut the file down to the records written.
+      void close()
+      {
+        if (data_) {
+          munmap(data_, capacity_);
+          if (ftruncate(fd_, size_) != 0)
+            size_ = 0;
+        }
+        if (fd_ >= 0)
+          ::close(fd_);
+        fd_ = -1;
+        data_ = NULL;
+        capacity_ = 0;
+        size_ = 0;
+      }
+
+    private:
+      static const size_t kInitialCapacity = 1 << 20;
+
+      bool reserve(size_t capacity)
+      {
+        if (ftruncate(fd_, capacity) != 0)
+          return false;
+        void* data = data_ ? mremap(data_, capacity_, capacity, MREMAP_MAYMOVE) :
+                             mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED)
+          return false;
+        data_ = static_cast<char*>(data);
+        capacity_ = capacity;
+        return true;
+      }
+
+      int fd_;
+      char* data_;
+      size_t capacity_;
+      size_t size_;
+  };
+
+  /// \brief Read-only mapping of a log written by StepLogWriter.
+  class StepLogReader {
+
+    public:
+      StepLogReader() : data_(NULL), size_(0), records_(NULL), count_(0) {}
+      ~StepLogReader() { close(); }
+
+      /// \return false if the file is missing or not a step log.
+      bool open(const std::string& path)
+      {
+        close();
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+          return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(StepLogFormat::Header)) {
+          void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (data != MAP_FAILED) {
+            data_ = static_cast<const char*>(data);
+            size_ = info.st_size;
+          }
+        }
+        ::close(fd);
+        if (!data_)
+          return false;
+
+        memcpy(&header_, data_, sizeof(header_));
+        if (header_.magic != StepLogFormat::kMagic || header_.version != StepLogFormat::kVersion) {
+          close();
+          return false;
+        }
+        records_ = reinterpret_cast<const StepLogFormat::Record*>(data_ + sizeof(header_));
+        count_ = (size_ - sizeof(header_)) / sizeof(StepLogFormat::Record);
+        return true;
+      }
+
+      void close()
+      {
+        if (data_)
+          munmap(const_cast<char*>(data_), size_);
+        data_ = NULL;
+        size_ = 0;
+        records_ = NULL;
+        count_ = 0;
+      }
+
+      const StepLogFormat::Header& header() const { return header_; }
+      size_t count() const { return count_; }
+      const StepLogFormat::Record& operator[](size_t i) const { return records_[i]; }
+
+    private:
+      const char* data_;
+      size_t size_;
+      StepLogFormat::Header header_;
+      const StepLogFormat::Record* records_;
+      size_t count_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_STEP_LOG_H */
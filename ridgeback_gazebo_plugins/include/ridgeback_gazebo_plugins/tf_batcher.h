@@ -0,0 +1,75 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: Process-wide collector that sends the odometry transforms of all
+ *       force based move instances as one tf2 message per world update.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_TF_BATCHER_H
+#define RIDGEBACK_GAZEBO_PLUGINS_TF_BATCHER_H
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <gazebo/common/Events.hh>
+#include <geometry_msgs/TransformStamped.h>
+#include <ros/ros.h>
+#include <tf2_msgs/TFMessage.h>
+
+namespace gazebo {
+
+  /// \brief Coalesces transforms into a single /tf message per tick.
+  ///
+  /// add() may be called from any thread. Everything added during a world
+  /// update is published together when the update ends.
+  class TfBatcher {
+
+    public:
+      /// \brief Get the process-wide batcher, creating it on first use.
+      static boost::shared_ptr<TfBatcher> acquire();
+
+      ~TfBatcher();
+
+      void add(const geometry_msgs::TransformStamped& transform);
+
+    private:
+      TfBatcher();
+
+      /// \brief Publish everything added since the previous flush.
+      void flush();
+
+      ros::NodeHandle rosnode_;
+      ros::Publisher tf_pub_;
+      event::ConnectionPtr update_end_connection_;
+
+      /// \brief The first pending_count_ entries are this update's. The
+      /// rest are kept from earlier batches, so add() assigns into strings
+      /// that already have their capacity instead of making new ones.
+      boost::mutex pending_mutex_;
+      std::vector<geometry_msgs::TransformStamped> pending_;
+      size_t pending_count_;
+      tf2_msgs::TFMessage batch_;
+
+      static boost::mutex instance_mutex_;
+      static boost::weak_ptr<TfBatcher> instance_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_TF_BATCHER_H */
@@ -0,0 +1,58 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: tf_prefix handling carried over from the tf package, which tf2
+ *       no longer provides.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_TF_PREFIX_H
+#define RIDGEBACK_GAZEBO_PLUGINS_TF_PREFIX_H
+
+#include <string>
+
+#include <ros/ros.h>
+
+namespace gazebo {
+
+  /// \brief Look up the tf_prefix parameter the way tf::getPrefixParam did.
+  inline std::string getTfPrefix(const ros::NodeHandle& nh)
+  {
+    std::string param;
+    if (!nh.searchParam("tf_prefix", param))
+      return "";
+
+    std::string prefix;
+    nh.getParam(param, prefix);
+    return prefix;
+  }
+
+  /// \brief Prepend prefix to frame_name with the semantics of tf::resolve.
+  inline std::string resolveFrame(const std::string& prefix, const std::string& frame_name)
+  {
+    if (!frame_name.empty() && frame_name[0] == '/')
+      return frame_name.substr(1);
+
+    if (prefix.empty())
+      return frame_name;
+
+    if (prefix[0] == '/')
+      return prefix.substr(1) + "/" + frame_name;
+    return prefix + "/" + frame_name;
+  }
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_TF_PREFIX_H */
@@ -0,0 +1,160 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+/*
+ * Desc: Timestamped velocity trajectory handed from a ROS callback to the
+ *       Gazebo update thread and interpolated there every step.
+ */
+
+#ifndef RIDGEBACK_GAZEBO_PLUGINS_VELOCITY_TRAJECTORY_H
+#define RIDGEBACK_GAZEBO_PLUGINS_VELOCITY_TRAJECTORY_H
+
+#include <atomic>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include <ros/time.h>
+#include <trajectory_msgs/MultiDOFJointTrajectory.h>
+
+namespace gazebo {
+
+  /// \brief Body velocity set points with absolute sim-time stamps.
+  class VelocityTrajectory {
+
+    public:
+      struct Point {
+        int64_t stamp_ns;
+        double x;
+        double y;
+        double rot;
+      };
+
+      VelocityTrajectory() : cursor_(0) {}
+
+      /// \brief Fill from the first velocity of every point. Points are
+      /// stamped header.stamp + time_from_start, or now + time_from_start
+      /// for a zero header stamp; points out of order are dropped.
+      void assign(const trajectory_msgs::MultiDOFJointTrajectory& msg, const ros::Time& now)
+      {
+        points_.clear();
+        cursor_ = 0;
+        const ros::Time start = msg.header.stamp.isZero() ? now : msg.header.stamp;
+        points_.reserve(msg.points.size());
+        for (size_t i = 0; i < msg.points.size(); ++i) {
+          const trajectory_msgs::MultiDOFJointTrajectoryPoint& point = msg.points[i];
+          if (point.velocities.empty())
+            continue;
+          Point sample;
+          sample.stamp_ns = static_cast<int64_t>((start + point.time_from_start).toNSec());
+          sample.x = point.velocities[0].linear.x;
+          sample.y = point.velocities[0].linear.y;
+          sample.rot = point.velocities[0].angular.z;
+          if (!points_.empty() && sample.stamp_ns <= points_.back().stamp_ns)
+            continue;
+          points_.push_back(sample);
+        }
+      }
+
+      bool empty() const { return points_.empty(); }
+      void clear() { points_.clear(); cursor_ = 0; }
+
+      int64_t endStamp() const { return points_.empty() ? 0 : points_.back().stamp_ns; }
+
+      /// \brief Velocity at now, linearly interpolated between set points and
+      /// held after the last one. Time only moves forward, so a cursor
+      /// keeps this O(1) per step.
+      /// \return False before the first point or when empty.
+      bool sample(int64_t now_ns, double& x, double& y, double& rot)
+      {
+        if (points_.empty() || now_ns < points_.front().stamp_ns)
+          return false;
+
+        while (cursor_ + 1 < points_.size() && points_[cursor_ + 1].stamp_ns <= now_ns)
+          ++cursor_;
+
+        const Point& from = points_[cursor_];
+        if (cursor_ + 1 == points_.size()) {
+          x = from.x;
+          y = from.y;
+          rot = from.rot;
+          return true;
+        }
+
+        const Point& to = points_[cursor_ + 1];
+        const double t = static_cast<double>(now_ns - from.stamp_ns) / (to.stamp_ns - from.stamp_ns);
+        x = from.x + (to.x - from.x) * t;
+        y = from.y + (to.y - from.y) * t;
+        rot = from.rot + (to.rot - from.rot) * t;
+        return true;
+      }
+
+      void swap(VelocityTrajectory& other)
+      {
+        points_.swap(other.points_);
+        std::swap(cursor_, other.cursor_);
+      }
+
+    private:
+      std::vector<Point> points_;
+      size_t cursor_;
+  };
+
+  /// \brief Latest trajectory waiting for the update thread.
+  ///
+  /// The callback converts the message outside the lock and swaps it in.
+  /// The update thread checks an atomic flag, then only try-locks, so a
+  /// step never waits on the callback. The trajectory it replaces is swapped
+  /// back out and freed on the callback thread.
+  class TrajectoryMailbox {
+
+    public:
+      TrajectoryMailbox() : pending_(false) {}
+
+      void write(const trajectory_msgs::MultiDOFJointTrajectory& msg, const ros::Time& now)
+      {
+        VelocityTrajectory trajectory;
+        trajectory.assign(msg, now);
+        boost::mutex::scoped_lock lock(mutex_);
+        trajectory_.swap(trajectory);
+        pending_.store(true, std::memory_order_release);
+      }
+
+      /// \brief Swap a newly written trajectory into active.
+      /// \return False if there is none or the writer holds the lock.
+      bool read(VelocityTrajectory& active)
+      {
+        if (!pending_.load(std::memory_order_acquire))
+          return false;
+        boost::mutex::scoped_try_lock lock(mutex_);
+        if (!lock.owns_lock())
+          return false;
+        active.swap(trajectory_);
+        pending_.store(false, std::memory_order_relaxed);
+        return true;
+      }
+
+    private:
+      boost::mutex mutex_;
+      VelocityTrajectory trajectory_;
+      std::atomic<bool> pending_;
+  };
+
+}
+
+#endif /* end of include guard: RIDGEBACK_GAZEBO_PLUGINS_VELOCITY_TRAJECTORY_H */
@@ -0,0 +1,178 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: Replacement global allocation functions that count calls per thread.
+ *       The library is linked with -Bsymbolic-functions when this file is
+ *       built, so only calls made from inside the plugin bind to these
+ *       definitions; the rest of gzserver keeps using libstdc++'s.
+ */
+
+#include <ridgeback_gazebo_plugins/allocation_counter.h>
+
+#include <stdlib.h>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+  thread_local uint64_t allocation_count = 0;
+
+  void* countedAllocate(std::size_t size)
+  {
+    ++allocation_count;
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr)
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+  void* countedAllocate(std::size_t size, const std::nothrow_t&) noexcept
+  {
+    ++allocation_count;
+    return std::malloc(size ? size : 1);
+  }
+
+#ifdef __cpp_aligned_new
+  void* countedAllocate(std::size_t size, std::align_val_t align) noexcept
+  {
+    ++allocation_count;
+    // posix_memalign wants at least pointer alignment; std::free releases it.
+    std::size_t alignment = static_cast<std::size_t>(align);
+    if (alignment < sizeof(void*))
+      alignment = sizeof(void*);
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, size ? size : 1) != 0)
+      return nullptr;
+    return ptr;
+  }
+#endif
+}
+
+namespace gazebo
+{
+  uint64_t threadAllocationCount()
+  {
+    return allocation_count;
+  }
+}
+
+void* operator new(std::size_t size)
+{
+  return countedAllocate(size);
+}
+
+void* operator new[](std::size_t size)
+{
+  return countedAllocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t& tag) noexcept
+{
+  return countedAllocate(size, tag);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+  return countedAllocate(size, tag);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+  std::free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(std::size_t size, std::align_val_t align)
+{
+  void* ptr = countedAllocate(size, align);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+  void* ptr = countedAllocate(size, align);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+  return countedAllocate(size, align);
+}
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+  return countedAllocate(size, align);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+  std::free(ptr);
+}
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <ridgeback_gazebo_plugins/callback_dispatcher.h>
+
+#include <ros/ros.h>
+
+namespace gazebo
+{
+
+  boost::mutex CallbackDispatcher::instance_mutex_;
+  boost::weak_ptr<CallbackDispatcher> CallbackDispatcher::instance_;
+
+  boost::shared_ptr<CallbackDispatcher> CallbackDispatcher::acquire(unsigned int num_threads)
+  {
+    boost::mutex::scoped_lock scoped_lock(instance_mutex_);
+    boost::shared_ptr<CallbackDispatcher> dispatcher = instance_.lock();
+    if (!dispatcher) {
+      dispatcher.reset(new CallbackDispatcher(num_threads));
+      instance_ = dispatcher;
+    }
+    return dispatcher;
+  }
+
+  CallbackDispatcher::CallbackDispatcher(unsigned int num_threads)
+    : running_(true), wakeups_(0), callbacks_(0)
+  {
+    if (num_threads == 0)
+      num_threads = 1;
+
+    for (unsigned int i = 0; i < num_threads; ++i)
+      workers_.create_thread(boost::bind(&CallbackDispatcher::workerThread, this));
+
+    ROS_INFO("ForceBasedMove callback dispatcher started with %u thread(s)", num_threads);
+  }
+
+  CallbackDispatcher::~CallbackDispatcher()
+  {
+    running_ = false;
+    // Wakes every worker blocked on the queue's condition variable.
+    queue_.disable();
+    workers_.join_all();
+    queue_.clear();
+
+    ROS_INFO("ForceBasedMove callback dispatcher stopped after %lu wake-ups for %lu callbacks",
+             static_cast<unsigned long>(wakeups_.load()),
+             static_cast<unsigned long>(callbacks_.load()));
+  }
+
+  void CallbackDispatcher::workerThread()
+  {
+    // The timeout only bounds how long a worker takes to notice ros::ok()
+    // going false; new callbacks and disable() both wake it immediately.
+    static const double idle_timeout = 1.0;
+    while (running_ && ros::ok())
+    {
+      ros::CallbackQueue::CallOneResult result =
+        queue_.callOne(ros::WallDuration(idle_timeout));
+      ++wakeups_;
+      if (result == ros::CallbackQueue::Called)
+        ++callbacks_;
+      else if (result == ros::CallbackQueue::Disabled)
+        break;
+    }
+  }
+
+}
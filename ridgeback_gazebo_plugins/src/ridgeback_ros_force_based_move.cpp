@@ -24,13 +24,54 @@
  */
 
 #include <ridgeback_gazebo_plugins/ridgeback_ros_force_based_move.h>
+#include <ridgeback_gazebo_plugins/tf_prefix.h>
+
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2/utils.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
 namespace gazebo
 {
 
-  GazeboRosForceBasedMove::GazeboRosForceBasedMove() {}
+  GazeboRosForceBasedMove::GazeboRosForceBasedMove() : alive_(false) {}
 
-  GazeboRosForceBasedMove::~GazeboRosForceBasedMove() {}
+  // Finalize the controller. ModelPlugin has no Fini hook, so this is the
+  // only place the threads and the node handle are torn down.
+  GazeboRosForceBasedMove::~GazeboRosForceBasedMove()
+  {
+    update_connection_.reset();
+    if (!rosnode_)
+      return;
+    // The reconfigure server has a node handle of its own, so shutting
+    // rosnode_ down leaves its services on the shared queue. Destroy it
+    // first: it must unregister before callback_dispatcher_ can free that
+    // queue, and before member teardown frees the config it writes into.
+    reconfigure_server_.reset();
+    alive_ = false;
+    // The publisher thread uses the odometry publishers and this object,
+    // so it has to be gone before the node handle is shut down.
+    if (odometry_publisher_thread_.joinable()) {
+      odometry_samples_available_->post();
+      odometry_publisher_thread_.join();
+      ROS_INFO("ForceBasedPlugin (ns = %s) async odometry: %lu published, %lu dropped, "
+          "max queue depth %lu",
+          robot_namespace_.c_str(),
+          static_cast<unsigned long>(async_published_samples_.load()),
+          static_cast<unsigned long>(async_dropped_samples_.load()),
+          static_cast<unsigned long>(async_max_queue_depth_.load()));
+    }
+    queue_.clear();
+    queue_.disable();
+    // Shutting down the node handle removes our callbacks from the shared
+    // queue and waits for any that are in flight.
+    rosnode_->shutdown();
+    if (callback_queue_thread_.joinable()) {
+      callback_queue_thread_.join();
+      ROS_INFO("ForceBasedPlugin (ns = %s) callback thread woke up %lu times",
+          robot_namespace_.c_str(), static_cast<unsigned long>(queue_wakeups_));
+    }
+    callback_dispatcher_.reset();
+  }
 
   // Load the controller
   void GazeboRosForceBasedMove::Load(physics::ModelPtr parent,
@@ -38,6 +79,7 @@ namespace gazebo
   {
 
     parent_ = parent;
+    world_ = parent->GetWorld();
 
     /* Parse parameters */
 
@@ -65,6 +107,12 @@ namespace gazebo
       command_topic_ = sdf->GetElement("commandTopic")->Get<std::string>();
     }
 
+    command_trajectory_topic_ = "cmd_vel_trajectory";
+    if (sdf->HasElement("commandTrajectoryTopic"))
+    {
+      command_trajectory_topic_ = sdf->GetElement("commandTrajectoryTopic")->Get<std::string>();
+    }
+
     odometry_topic_ = "odom";
     if (!sdf->HasElement("odometryTopic"))
     {
@@ -107,6 +155,30 @@ namespace gazebo
                                                  " x: " << force_x_velocity_p_gain_ <<
                                                  " y: " << force_y_velocity_p_gain_ << "\n");
 
+    this->kinematic_ = false;
+    if (sdf->HasElement("mode")) {
+      std::string mode = sdf->GetElement("mode")->Get<std::string>();
+      if (mode == "kinematic") {
+        this->kinematic_ = true;
+      } else if (mode != "dynamic") {
+        ROS_WARN("ForceBasedPlugin (ns = %s) unknown <mode> \"%s\", "
+            "defaults to \"dynamic\"",
+            this->robot_namespace_.c_str(), mode.c_str());
+      }
+    }
+
+    this->feed_forward_control_ = false;
+    if (sdf->HasElement("controllerMode")) {
+      std::string mode = sdf->GetElement("controllerMode")->Get<std::string>();
+      if (mode == "feed_forward") {
+        this->feed_forward_control_ = true;
+      } else if (mode != "p") {
+        ROS_WARN("ForceBasedPlugin (ns = %s) unknown <controllerMode> \"%s\", "
+            "defaults to \"p\"",
+            this->robot_namespace_.c_str(), mode.c_str());
+      }
+    }
+
     robot_base_frame_ = "base_footprint";
     if (!sdf->HasElement("robotBaseFrame"))
     {
@@ -123,6 +195,20 @@ namespace gazebo
 
     this->link_ = parent->GetLink(robot_base_frame_);
 
+    // Without wheel contact nothing holds the robot up, so gravity goes too
+    // and the robot keeps its spawn height.
+    this->kinematic_floating_ = false;
+    if (this->kinematic_ && sdf->HasElement("kinematicWheelCollisions") &&
+        !sdf->GetElement("kinematicWheelCollisions")->Get<bool>()) {
+      const physics::Link_V& links = parent_->GetLinks();
+      for (physics::Link_V::const_iterator it = links.begin(); it != links.end(); ++it) {
+        if (*it != this->link_)
+          (*it)->SetCollideMode("none");
+      }
+      parent_->SetGravityMode(false);
+      this->kinematic_floating_ = true;
+    }
+
     odometry_rate_ = 20.0;
     if (!sdf->HasElement("odometryRate"))
     {
@@ -155,12 +241,216 @@ namespace gazebo
       this->publish_odometry_tf_ = sdf->GetElement("publishOdometryTf")->Get<bool>();
     }
 
-    last_odom_publish_time_ = parent_->GetWorld()->SimTime();
-    last_odom_pose_ = parent_->WorldPose();
+    bool batch_tf = false;
+    if (sdf->HasElement("batchTf"))
+      batch_tf = sdf->GetElement("batchTf")->Get<bool>();
+
+    this->lock_free_commands_ = true;
+    if (sdf->HasElement("commandSync")) {
+      std::string command_sync = sdf->GetElement("commandSync")->Get<std::string>();
+      if (command_sync == "mutex") {
+        this->lock_free_commands_ = false;
+      } else if (command_sync != "lockfree") {
+        ROS_WARN("ForceBasedPlugin (ns = %s) unknown <commandSync> \"%s\", "
+            "defaults to \"lockfree\"",
+            this->robot_namespace_.c_str(), command_sync.c_str());
+      }
+    }
+
+    std::string callback_dispatch = "thread";
+    if (sdf->HasElement("callbackDispatch"))
+      callback_dispatch = sdf->GetElement("callbackDispatch")->Get<std::string>();
+
+    unsigned int dispatcher_threads = 1;
+    if (sdf->HasElement("dispatcherThreads"))
+      dispatcher_threads = sdf->GetElement("dispatcherThreads")->Get<unsigned int>();
+
+    // Commands from a client publishing faster than this (per wall
+    // second) are dropped in the callback; see CommandInputStage.
+    double max_command_rate = 0.0;
+    if (sdf->HasElement("maxCommandRate"))
+      max_command_rate = sdf->GetElement("maxCommandRate")->Get<double>();
+    this->command_input_.configure(max_command_rate);
+
+    this->async_publish_ = false;
+    if (sdf->HasElement("asyncPublish"))
+      this->async_publish_ = sdf->GetElement("asyncPublish")->Get<bool>();
+
+    unsigned int async_queue_size = 16;
+    if (sdf->HasElement("asyncPublishQueueSize"))
+      async_queue_size = sdf->GetElement("asyncPublishQueueSize")->Get<unsigned int>();
+
+    bool zero_copy_odometry = false;
+    if (sdf->HasElement("zeroCopyOdometry"))
+      zero_copy_odometry = sdf->GetElement("zeroCopyOdometry")->Get<bool>();
+
+    unsigned int zero_copy_pool_size = 8;
+    if (sdf->HasElement("zeroCopyPoolSize"))
+      zero_copy_pool_size = sdf->GetElement("zeroCopyPoolSize")->Get<unsigned int>();
+
+    unsigned int odometry_max_batch = 1;
+    if (sdf->HasElement("odometryCatchUp")) {
+      std::string catch_up = sdf->GetElement("odometryCatchUp")->Get<std::string>();
+      if (catch_up == "batch") {
+        odometry_max_batch = 5;
+        if (sdf->HasElement("odometryMaxBatch"))
+          odometry_max_batch = sdf->GetElement("odometryMaxBatch")->Get<unsigned int>();
+      } else if (catch_up != "skip") {
+        ROS_WARN("ForceBasedPlugin (ns = %s) unknown <odometryCatchUp> \"%s\", "
+            "defaults to \"skip\"",
+            this->robot_namespace_.c_str(), catch_up.c_str());
+      }
+    }
+
+    this->first_order_odometry_ = false;
+    if (sdf->HasElement("odometryIntegrator")) {
+      std::string integrator = sdf->GetElement("odometryIntegrator")->Get<std::string>();
+      if (integrator == "first_order") {
+        this->first_order_odometry_ = true;
+      } else if (integrator != "exact") {
+        ROS_WARN("ForceBasedPlugin (ns = %s) unknown <odometryIntegrator> \"%s\", "
+            "defaults to \"exact\"",
+            this->robot_namespace_.c_str(), integrator.c_str());
+      }
+    }
+
+    this->per_step_odometry_ = false;
+    if (sdf->HasElement("odometryPerStep"))
+      this->per_step_odometry_ = sdf->GetElement("odometryPerStep")->Get<bool>();
+    if (this->per_step_odometry_ && this->first_order_odometry_) {
+      ROS_WARN("ForceBasedPlugin (ns = %s) <odometryPerStep> always integrates exactly, "
+          "ignoring <odometryIntegrator>", this->robot_namespace_.c_str());
+    }
+    this->physics_step_size_ = world_->Physics()->GetMaxStepSize();
+
+    if (this->feed_forward_control_) {
+      FeedForwardController::Parameters controller = feedForwardParameters(sdf);
+      modelInertia(parent_, link_, controller.mass, controller.yaw_inertia);
+      if (sdf->HasElement("controllerMass"))
+        controller.mass = sdf->GetElement("controllerMass")->Get<double>();
+      if (sdf->HasElement("controllerYawInertia"))
+        controller.yaw_inertia = sdf->GetElement("controllerYawInertia")->Get<double>();
+      this->controller_.configure(controller);
+
+      // The controller reschedules on the measured step; this only reports
+      // the cap at the step size the world starts with.
+      const double cap = controller.stability_margin / this->physics_step_size_;
+      if (controller.linear_bandwidth > cap || controller.angular_bandwidth > cap) {
+        ROS_WARN("ForceBasedPlugin (ns = %s) bandwidth limited to %f 1/s at %f s steps",
+            this->robot_namespace_.c_str(), cap, this->physics_step_size_);
+      }
+      ROS_INFO("ForceBasedPlugin (ns = %s) feed-forward control with mass %f kg, yaw inertia %f kg m^2",
+          this->robot_namespace_.c_str(), controller.mass, controller.yaw_inertia);
+    }
+
+    this->ground_truth_odometry_ = false;
+    if (sdf->HasElement("odometrySource")) {
+      std::string source = sdf->GetElement("odometrySource")->Get<std::string>();
+      if (source == "ground_truth") {
+        this->ground_truth_odometry_ = true;
+      } else if (source != "integrated") {
+        ROS_WARN("ForceBasedPlugin (ns = %s) unknown <odometrySource> \"%s\", "
+            "defaults to \"integrated\"",
+            this->robot_namespace_.c_str(), source.c_str());
+      }
+    }
+    if (this->ground_truth_odometry_ && this->per_step_odometry_) {
+      ROS_WARN("ForceBasedPlugin (ns = %s) ground truth odometry ignores <odometryPerStep>",
+          this->robot_namespace_.c_str());
+      this->per_step_odometry_ = false;
+    }
+
+    OdometryNoise::Parameters noise;
+    if (sdf->HasElement("odometryPositionNoise"))
+      noise.position_stddev = sdf->GetElement("odometryPositionNoise")->Get<double>();
+    if (sdf->HasElement("odometryYawNoise"))
+      noise.yaw_stddev = sdf->GetElement("odometryYawNoise")->Get<double>();
+    if (sdf->HasElement("odometryPositionDrift"))
+      noise.position_drift = sdf->GetElement("odometryPositionDrift")->Get<double>();
+    if (sdf->HasElement("odometryYawDrift"))
+      noise.yaw_drift = sdf->GetElement("odometryYawDrift")->Get<double>();
+    unsigned int noise_seed = 0;
+    if (sdf->HasElement("odometryNoiseSeed"))
+      noise_seed = sdf->GetElement("odometryNoiseSeed")->Get<unsigned int>();
+    noise.seed = OdometryNoise::seedFor(noise_seed, parent_->GetScopedName());
+    this->odometry_noise_.configure(noise);
+    if (this->odometry_noise_.enabled() && !this->ground_truth_odometry_) {
+      ROS_WARN("ForceBasedPlugin (ns = %s) odometry noise only applies with "
+          "<odometrySource>ground_truth</odometrySource>", this->robot_namespace_.c_str());
+    }
+
+    this->idle_sleep_.configure(IdleSleep::parameters(sdf));
+
+    // <stepLog> records the commands applied and the odometry published on
+    // each step, or replays the commands of such a recording without
+    // subscribing to cmd_vel.
+    this->step_log_mode_ = kStepLogOff;
+    if (sdf->HasElement("stepLog")) {
+      const std::string path = sdf->GetElement("stepLog")->Get<std::string>();
+      std::string mode = "record";
+      if (sdf->HasElement("stepLogMode"))
+        mode = sdf->GetElement("stepLogMode")->Get<std::string>();
+      if (mode == "replay") {
+        if (!this->step_log_reader_.open(path)) {
+          ROS_ERROR("ForceBasedPlugin (ns = %s) cannot read step log \"%s\", not replaying",
+              this->robot_namespace_.c_str(), path.c_str());
+        } else {
+          this->step_log_mode_ = kStepLogReplay;
+          if (this->step_log_reader_.header().step_size != this->physics_step_size_) {
+            ROS_WARN("ForceBasedPlugin (ns = %s) step log was recorded at %f s steps, replaying at %f s",
+                this->robot_namespace_.c_str(), this->step_log_reader_.header().step_size,
+                this->physics_step_size_);
+          }
+          ROS_INFO("ForceBasedPlugin (ns = %s) replaying %lu records from \"%s\"",
+              this->robot_namespace_.c_str(), static_cast<unsigned long>(this->step_log_reader_.count()),
+              path.c_str());
+        }
+      } else {
+        if (mode != "record") {
+          ROS_WARN("ForceBasedPlugin (ns = %s) unknown <stepLogMode> \"%s\", "
+              "defaults to \"record\"",
+              this->robot_namespace_.c_str(), mode.c_str());
+        }
+        if (!this->step_log_writer_.open(path, this->physics_step_size_)) {
+          ROS_ERROR("ForceBasedPlugin (ns = %s) cannot write step log \"%s\", not recording",
+              this->robot_namespace_.c_str(), path.c_str());
+        } else {
+          this->step_log_mode_ = kStepLogRecord;
+        }
+      }
+    }
+    replay_command_cursor_ = 0;
+    replay_odometry_cursor_ = 0;
+    replay_mismatches_ = 0;
+    logged_x_ = 0.0;
+    logged_y_ = 0.0;
+    logged_rot_ = 0.0;
+    command_logged_ = false;
+
+    double diagnostics_rate = 0.0;
+    if (sdf->HasElement("diagnosticsRate"))
+      diagnostics_rate = sdf->GetElement("diagnosticsRate")->Get<double>();
+
+    this->profiling_ = diagnostics_rate > 0.0 && StepHistogram::kCompiledIn;
+    if (diagnostics_rate > 0.0 && !StepHistogram::kCompiledIn) {
+      ROS_WARN("ForceBasedPlugin (ns = %s) was built without ENABLE_PROFILING, "
+          "ignoring <diagnosticsRate>", this->robot_namespace_.c_str());
+    }
+
+    step_clock_.set(world_->SimTime());
+    odometry_scheduler_.configure(odometry_rate_, world_->SimTime(), odometry_max_batch);
+    spawn_pose_ = parent_->WorldPose();
     x_ = 0.0;
     y_ = 0.0;
     rot_ = 0.0;
     alive_ = true;
+    queue_wakeups_ = 0;
+    async_published_samples_ = 0;
+    async_dropped_samples_ = 0;
+    async_max_queue_depth_ = 0;
+    last_cmd_received_ns_ = 0;
+    new_command_ = false;
+    has_snapshot_ = false;
 
     odom_transform_.setIdentity();
 
@@ -178,23 +468,143 @@ namespace gazebo
     ROS_DEBUG("OCPlugin (%s) has started!",
         robot_namespace_.c_str());
 
-    tf_prefix_ = tf::getPrefixParam(*rosnode_);
+    tf_prefix_ = getTfPrefix(*rosnode_);
+
+    // Resolved once here so publishOdometry() only touches fields that change.
+    odom_.header.frame_id = resolveFrame(tf_prefix_, odometry_frame_);
+    odom_.child_frame_id = resolveFrame(tf_prefix_, robot_base_frame_);
+    odom_stamped_transform_.header.frame_id = odom_.header.frame_id;
+    odom_stamped_transform_.child_frame_id = odom_.child_frame_id;
+
+    odom_.pose.covariance[0] = 0.001;
+    odom_.pose.covariance[7] = 0.001;
+    odom_.pose.covariance[14] = 1000000000000.0;
+    odom_.pose.covariance[21] = 1000000000000.0;
+    odom_.pose.covariance[28] = 1000000000000.0;
+
+    odom_.twist.covariance[0] = 0.001;
+    odom_.twist.covariance[7] = 0.001;
+    odom_.twist.covariance[14] = 0.001;
+    odom_.twist.covariance[21] = 1000000000000.0;
+    odom_.twist.covariance[28] = 1000000000000.0;
+
+    // Pooled messages copy the fields set up to here from odom_.
+    if (zero_copy_odometry)
+      odometry_pool_.reset(new OdometryPool(zero_copy_pool_size, odom_));
+
+    // With <batchTf> the odom transforms of every instance in this gzserver
+    // go out together as one /tf message at the end of each world update.
+    if (publish_odometry_tf_) {
+      if (batch_tf)
+        tf_batcher_ = TfBatcher::acquire();
+      else
+        transform_broadcaster_.reset(new tf2_ros::TransformBroadcaster());
+    }
 
-    if (publish_odometry_tf_)
-      transform_broadcaster_.reset(new tf::TransformBroadcaster());
+    // Fixed for the lifetime of the plugin, so the async publisher thread
+    // can call through publish_odometry_ without synchronization.
+    static const PublishOdometry publishers[3][2][2] = {
+      {{&GazeboRosForceBasedMove::publishOdometry<kNoTf, false, false>,
+        &GazeboRosForceBasedMove::publishOdometry<kNoTf, false, true>},
+       {&GazeboRosForceBasedMove::publishOdometry<kNoTf, true, false>,
+        &GazeboRosForceBasedMove::publishOdometry<kNoTf, true, true>}},
+      {{&GazeboRosForceBasedMove::publishOdometry<kBatchedTf, false, false>,
+        &GazeboRosForceBasedMove::publishOdometry<kBatchedTf, false, true>},
+       {&GazeboRosForceBasedMove::publishOdometry<kBatchedTf, true, false>,
+        &GazeboRosForceBasedMove::publishOdometry<kBatchedTf, true, true>}},
+      {{&GazeboRosForceBasedMove::publishOdometry<kBroadcastTf, false, false>,
+        &GazeboRosForceBasedMove::publishOdometry<kBroadcastTf, false, true>},
+       {&GazeboRosForceBasedMove::publishOdometry<kBroadcastTf, true, false>,
+        &GazeboRosForceBasedMove::publishOdometry<kBroadcastTf, true, true>}}};
+    const TfPolicy tf = tf_batcher_ ? kBatchedTf : transform_broadcaster_ ? kBroadcastTf : kNoTf;
+    publish_odometry_ = publishers[tf][odometry_pool_ ? 1 : 0][profiling_];
+
+    ros::CallbackQueue* callback_queue = &queue_;
+    if (callback_dispatch == "shared") {
+      callback_dispatcher_ = CallbackDispatcher::acquire(dispatcher_threads);
+      callback_queue = callback_dispatcher_->queue();
+    } else if (callback_dispatch != "thread") {
+      ROS_WARN("ForceBasedPlugin (ns = %s) unknown <callbackDispatch> \"%s\", "
+          "defaults to \"thread\"",
+          robot_namespace_.c_str(), callback_dispatch.c_str());
+    }
 
     // subscribe to the odometry topic
-    ros::SubscribeOptions so =
-      ros::SubscribeOptions::create<geometry_msgs::Twist>(command_topic_, 1,
-          boost::bind(&GazeboRosForceBasedMove::cmdVelCallback, this, _1),
-          ros::VoidPtr(), &queue_);
+    // The callback takes a ConstPtr, so publishers in this process (e.g.
+    // nodelets in a gzserver manager) hand over their message without a
+    // serialize/deserialize round trip.
+    // A replay takes its commands from the step log only.
+    if (step_log_mode_ != kStepLogReplay) {
+      ros::SubscribeOptions so =
+        ros::SubscribeOptions::create<geometry_msgs::Twist>(command_topic_, 1,
+            boost::bind(&GazeboRosForceBasedMove::cmdVelCallback, this, _1),
+            ros::VoidPtr(), callback_queue);
+
+      vel_sub_ = rosnode_->subscribe(so);
+    }
 
-    vel_sub_ = rosnode_->subscribe(so);
+    // Planners can send a whole velocity profile instead of streaming
+    // cmd_vel at the physics rate; an empty topic name turns this off.
+    if (!command_trajectory_topic_.empty() && step_log_mode_ != kStepLogReplay) {
+      ros::SubscribeOptions trajectory_so =
+        ros::SubscribeOptions::create<trajectory_msgs::MultiDOFJointTrajectory>(command_trajectory_topic_, 1,
+            boost::bind(&GazeboRosForceBasedMove::trajectoryCallback, this, _1),
+            ros::VoidPtr(), callback_queue);
+      trajectory_sub_ = rosnode_->subscribe(trajectory_so);
+    }
     odometry_pub_ = rosnode_->advertise<nav_msgs::Odometry>(odometry_topic_, 1);
 
+    // Episode reset without reloading the world: snapshot_state keeps the
+    // model and plugin state in memory, restore_state puts it back.
+    ros::AdvertiseServiceOptions snapshot_so =
+      ros::AdvertiseServiceOptions::create<std_srvs::Trigger>("snapshot_state",
+          boost::bind(&GazeboRosForceBasedMove::snapshotCallback, this, _1, _2),
+          ros::VoidPtr(), callback_queue);
+    snapshot_srv_ = rosnode_->advertiseService(snapshot_so);
+    ros::AdvertiseServiceOptions restore_so =
+      ros::AdvertiseServiceOptions::create<std_srvs::Trigger>("restore_state",
+          boost::bind(&GazeboRosForceBasedMove::restoreCallback, this, _1, _2),
+          ros::VoidPtr(), callback_queue);
+    restore_srv_ = rosnode_->advertiseService(restore_so);
+
+    // Gains and rates can be tuned on ~force_based_move while the world
+    // runs. The server starts out with the values read from the SDF.
+    config_pending_ = false;
+    ros::NodeHandle reconfigure_nh(*rosnode_, "force_based_move");
+    reconfigure_nh.setCallbackQueue(callback_queue);
+    reconfigure_server_.reset(new ReconfigureServer(reconfigure_server_mutex_, reconfigure_nh));
+    ridgeback_gazebo_plugins::ForceBasedMoveConfig config;
+    config.yaw_velocity_p_gain = torque_yaw_velocity_p_gain_;
+    config.x_velocity_p_gain = force_x_velocity_p_gain_;
+    config.y_velocity_p_gain = force_y_velocity_p_gain_;
+    config.odometry_rate = odometry_rate_;
+    config.cmd_vel_time_out = cmd_vel_time_out_;
+    reconfigure_server_->updateConfig(config);
+    reconfigure_server_->setCallback(
+        boost::bind(&GazeboRosForceBasedMove::reconfigureCallback, this, _1, _2));
+
+    if (profiling_) {
+      diagnostics_pub_ = rosnode_->advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+      diagnostics_timer_ = rosnode_->createWallTimer(ros::WallTimerOptions(
+          ros::WallDuration(1.0 / diagnostics_rate),
+          boost::bind(&GazeboRosForceBasedMove::publishDiagnostics, this, _1),
+          callback_queue));
+    }
+
+    // odometry and TF are built and sent off the update thread
+    if (async_publish_) {
+      odometry_samples_.reset(new OdometrySampleQueue(async_queue_size > 0 ? async_queue_size : 1));
+      odometry_samples_available_.reset(new boost::interprocess::interprocess_semaphore(0));
+      odometry_publisher_thread_ =
+        boost::thread(boost::bind(&GazeboRosForceBasedMove::OdometryPublisherThread, this));
+    }
+
     // start custom queue for diff drive
-    callback_queue_thread_ =
-      boost::thread(boost::bind(&GazeboRosForceBasedMove::QueueThread, this));
+    if (!callback_dispatcher_)
+      callback_queue_thread_ =
+        boost::thread(boost::bind(&GazeboRosForceBasedMove::QueueThread, this));
+
+    selectSteps();
 
     // listen to the update event (broadcast every simulation iteration)
     update_connection_ =
@@ -206,62 +616,499 @@ namespace gazebo
   // Update the controller
   void GazeboRosForceBasedMove::UpdateChild()
   {
-    boost::mutex::scoped_lock scoped_lock(lock);
-    ignition::math::Pose3d pose = parent_->WorldPose();
+    (this->*update_step_)();
+  }
 
-    if ((parent_->GetWorld()->SimTime() - last_cmd_vel_time_) > cmd_vel_time_out_) {
+  // The per-step work is specialized on everything the SDF fixes, so the
+  // instantiation selectSteps() picks only contains what is enabled.
+  template <bool kLockFree, bool kProfiling, GazeboRosForceBasedMove::StepLogMode StepLog>
+  void GazeboRosForceBasedMove::updateStep()
+  {
+    ScopedStepTimer update_timer(kProfiling ? &update_histogram_ : NULL);
+
+    const common::Time sim_time = world_->SimTime();
+    step_clock_.set(sim_time);
+
+    snapshot_handoff_.poll(boost::bind(&GazeboRosForceBasedMove::applySnapshotAction, this, _1));
+    applyPendingConfig(sim_time);
+
+    boost::mutex::scoped_lock scoped_lock(lock, boost::defer_lock);
+    bool new_command = false;
+    if (kLockFree) {
+      CommandMailbox::Command cmd;
+      if (command_mailbox_.read(cmd)) {
+        x_ = cmd.x;
+        y_ = cmd.y;
+        rot_ = cmd.rot;
+        last_cmd_vel_time_ = cmd.stamp;
+        new_command = true;
+      }
+    } else {
+      const uint64_t wait_start = kProfiling ? profilerNow() : 0;
+      scoped_lock.lock();
+      if (kProfiling)
+        mutex_wait_histogram_.record(profilerNow() - wait_start);
+      new_command = new_command_;
+      new_command_ = false;
+    }
+    if (kProfiling && new_command)
+      command_latency_histogram_.record(profilerNow() - last_cmd_received_ns_);
+
+    if ((sim_time - last_cmd_vel_time_) > cmd_vel_time_out_) {
       x_ = 0.0;
       y_ = 0.0;
       rot_ = 0.0;
     }
 
-    ignition::math::Vector3d angular_vel = parent_->WorldAngularVel();
-    link_->AddTorque(ignition::math::Vector3d(0.0,
-                                   0.0,
-                                   (rot_ - angular_vel.Z()) * torque_yaw_velocity_p_gain_));
+    // A trajectory overrides cmd_vel until it runs out; a newer cmd_vel
+    // message cancels it.
+    if (new_command)
+      trajectory_.clear();
+    trajectory_mailbox_.read(trajectory_);
+    if (!trajectory_.empty()) {
+      const int64_t now_ns = toNanoseconds(sim_time);
+      if (now_ns - trajectory_.endStamp() > static_cast<int64_t>(cmd_vel_time_out_ * 1e9)) {
+        trajectory_.clear();
+      } else {
+        trajectory_.sample(now_ns, x_, y_, rot_);
+      }
+    }
 
-    // float yaw = pose.rot.GetYaw();
+    if (StepLog == kStepLogReplay)
+      replayCommand(sim_time);
+    else if (StepLog == kStepLogRecord)
+      recordCommand(sim_time);
+
+    // A sleeping base wakes on a command, or when ODE has re-enabled it
+    // because an enabled body touched it.
+    const bool commanded = x_ != 0.0 || y_ != 0.0 || rot_ != 0.0;
+    if (idle_sleep_.asleep() && (commanded || link_->GetEnabled()))
+      wakeUp();
+
+    // As simulated, rather than the step size read at Load(): the world's
+    // max_step_size can be changed while it runs.
+    const double step_size = step_clock_.stepSize() > 0.0 ? step_clock_.stepSize() : physics_step_size_;
+    if (!idle_sleep_.asleep())
+      (this->*control_step_)(commanded, step_size);
+    (this->*odometry_step_)(sim_time);
+  }
 
-    ignition::math::Vector3d linear_vel = parent_->RelativeLinearVel();
+  template <GazeboRosForceBasedMove::ControlPolicy Control, bool kPerStepOdometry, bool kSleep>
+  void GazeboRosForceBasedMove::controlStep(bool commanded, double step_size)
+  {
+    const ignition::math::Vector3d angular_vel = parent_->WorldAngularVel();
+    const ignition::math::Vector3d linear_vel = parent_->RelativeLinearVel();
+
+    if (Control == kKinematicControl) {
+      const double yaw = parent_->WorldPose().Rot().Yaw();
+      const double cos_yaw = cos(yaw);
+      const double sin_yaw = sin(yaw);
+      parent_->SetLinearVel(ignition::math::Vector3d(
+            x_ * cos_yaw - y_ * sin_yaw,
+            y_ * cos_yaw + x_ * sin_yaw,
+            kinematic_floating_ ? 0.0 : parent_->WorldLinearVel().Z()));
+      parent_->SetAngularVel(ignition::math::Vector3d(0, 0, rot_));
+    } else if (Control == kFeedForwardControl) {
+      double force_x, force_y, torque_z;
+      controller_.update(x_, y_, rot_, linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_size,
+                         force_x, force_y, torque_z);
+      link_->AddTorque(ignition::math::Vector3d(0.0, 0.0, torque_z));
+      link_->AddRelativeForce(ignition::math::Vector3d(force_x, force_y, 0.0));
+    } else {
+      link_->AddTorque(ignition::math::Vector3d(0.0,
+                                     0.0,
+                                     (rot_ - angular_vel.Z()) * torque_yaw_velocity_p_gain_));
+
+      link_->AddRelativeForce(ignition::math::Vector3d((x_ - linear_vel.X())* force_x_velocity_p_gain_,
+                                            (y_ - linear_vel.Y())* force_y_velocity_p_gain_,
+                                            0.0));
+    }
+
+    // Body and world z coincide for a planar base, so the world yaw rate
+    // read for the controller doubles as the body yaw rate here.
+    if (kPerStepOdometry)
+      odometry_accumulator_.add(linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_size);
 
-    link_->AddRelativeForce(ignition::math::Vector3d((x_ - linear_vel.X())* force_x_velocity_p_gain_,
-                                          (y_ - linear_vel.Y())* force_y_velocity_p_gain_,
-                                          0.0));
-    //parent_->PlaceOnNearestEntityBelow();
-    //parent_->SetLinearVel(ignition::math::Vector3d(
-    //      x_ * cosf(yaw) - y_ * sinf(yaw),
-    //      y_ * cosf(yaw) + x_ * sinf(yaw),
-    //      0));
-    //parent_->SetAngularVel(ignition::math::Vector3d(0, 0, rot_));
-
-    if (odometry_rate_ > 0.0) {
-      common::Time current_time = parent_->GetWorld()->SimTime();
-      double seconds_since_last_update =
-        (current_time - last_odom_publish_time_).Double();
-      if (seconds_since_last_update > (1.0 / odometry_rate_)) {
-        publishOdometry(seconds_since_last_update);
-        last_odom_publish_time_ = current_time;
+    if (kSleep && idle_sleep_.update(commanded, hypot(linear_vel.X(), linear_vel.Y()), angular_vel.Z(),
+                                     step_size))
+      fallAsleep();
+  }
+
+  template <bool kAsync, GazeboRosForceBasedMove::OdometrySource Source, bool kStepLog>
+  void GazeboRosForceBasedMove::odometryStep(const common::Time& sim_time)
+  {
+    const unsigned int due = odometry_scheduler_.poll(sim_time);
+    for (unsigned int i = 0; i < due; ++i) {
+      const common::Time stamp = odometry_scheduler_.stamp(i);
+      OdometrySample sample = sampleOdometry<Source>(odometry_scheduler_.stepTime(i),
+                                                     ros::Time(stamp.sec, stamp.nsec), i + 1 == due);
+      if (kStepLog)
+        logOdometry(sample);
+      if (kAsync) {
+        if (odometry_samples_->push(sample))
+          odometry_samples_available_->post();
+        else
+          ++async_dropped_samples_;
+      } else {
+        (this->*publish_odometry_)(sample);
       }
     }
   }
 
-  // Finalize the controller
-  void GazeboRosForceBasedMove::FiniChild() {
-    alive_ = false;
-    queue_.clear();
-    queue_.disable();
-    rosnode_->shutdown();
-    callback_queue_thread_.join();
+  void GazeboRosForceBasedMove::noOdometryStep(const common::Time& sim_time) {}
+
+  void GazeboRosForceBasedMove::selectSteps()
+  {
+    static const UpdateStep update_steps[2][2][3] = {
+      {{&GazeboRosForceBasedMove::updateStep<false, false, kStepLogOff>,
+        &GazeboRosForceBasedMove::updateStep<false, false, kStepLogRecord>,
+        &GazeboRosForceBasedMove::updateStep<false, false, kStepLogReplay>},
+       {&GazeboRosForceBasedMove::updateStep<false, true, kStepLogOff>,
+        &GazeboRosForceBasedMove::updateStep<false, true, kStepLogRecord>,
+        &GazeboRosForceBasedMove::updateStep<false, true, kStepLogReplay>}},
+      {{&GazeboRosForceBasedMove::updateStep<true, false, kStepLogOff>,
+        &GazeboRosForceBasedMove::updateStep<true, false, kStepLogRecord>,
+        &GazeboRosForceBasedMove::updateStep<true, false, kStepLogReplay>},
+       {&GazeboRosForceBasedMove::updateStep<true, true, kStepLogOff>,
+        &GazeboRosForceBasedMove::updateStep<true, true, kStepLogRecord>,
+        &GazeboRosForceBasedMove::updateStep<true, true, kStepLogReplay>}}};
+    update_step_ = update_steps[lock_free_commands_][profiling_][step_log_mode_];
+
+    static const ControlStep control_steps[3][2][2] = {
+      {{&GazeboRosForceBasedMove::controlStep<kVelocityControl, false, false>,
+        &GazeboRosForceBasedMove::controlStep<kVelocityControl, false, true>},
+       {&GazeboRosForceBasedMove::controlStep<kVelocityControl, true, false>,
+        &GazeboRosForceBasedMove::controlStep<kVelocityControl, true, true>}},
+      {{&GazeboRosForceBasedMove::controlStep<kFeedForwardControl, false, false>,
+        &GazeboRosForceBasedMove::controlStep<kFeedForwardControl, false, true>},
+       {&GazeboRosForceBasedMove::controlStep<kFeedForwardControl, true, false>,
+        &GazeboRosForceBasedMove::controlStep<kFeedForwardControl, true, true>}},
+      {{&GazeboRosForceBasedMove::controlStep<kKinematicControl, false, false>,
+        &GazeboRosForceBasedMove::controlStep<kKinematicControl, false, true>},
+       {&GazeboRosForceBasedMove::controlStep<kKinematicControl, true, false>,
+        &GazeboRosForceBasedMove::controlStep<kKinematicControl, true, true>}}};
+
+    const ControlPolicy control = kinematic_ ? kKinematicControl :
+                                  feed_forward_control_ ? kFeedForwardControl : kVelocityControl;
+    control_step_ = control_steps[control][per_step_odometry_][idle_sleep_.enabled()];
+
+    static const OdometryStep odometry_steps[2][4][2] = {
+      {{&GazeboRosForceBasedMove::odometryStep<false, kExactOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<false, kExactOdometry, true>},
+       {&GazeboRosForceBasedMove::odometryStep<false, kFirstOrderOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<false, kFirstOrderOdometry, true>},
+       {&GazeboRosForceBasedMove::odometryStep<false, kAccumulatedOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<false, kAccumulatedOdometry, true>},
+       {&GazeboRosForceBasedMove::odometryStep<false, kGroundTruthOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<false, kGroundTruthOdometry, true>}},
+      {{&GazeboRosForceBasedMove::odometryStep<true, kExactOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<true, kExactOdometry, true>},
+       {&GazeboRosForceBasedMove::odometryStep<true, kFirstOrderOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<true, kFirstOrderOdometry, true>},
+       {&GazeboRosForceBasedMove::odometryStep<true, kAccumulatedOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<true, kAccumulatedOdometry, true>},
+       {&GazeboRosForceBasedMove::odometryStep<true, kGroundTruthOdometry, false>,
+        &GazeboRosForceBasedMove::odometryStep<true, kGroundTruthOdometry, true>}}};
+
+    // Load() turns <odometryPerStep> off for ground truth odometry.
+    const OdometrySource source = ground_truth_odometry_ ? kGroundTruthOdometry :
+                                  per_step_odometry_ ? kAccumulatedOdometry :
+                                  first_order_odometry_ ? kFirstOrderOdometry : kExactOdometry;
+    if (!odometry_scheduler_.enabled())
+      odometry_step_ = &GazeboRosForceBasedMove::noOdometryStep;
+    else
+      odometry_step_ = odometry_steps[async_publish_][source][step_log_mode_ != kStepLogOff];
+  }
+
+  void GazeboRosForceBasedMove::Reset()
+  {
+    // Called on the update thread with sim time already back at zero, so
+    // the publish deadlines start over too.
+    if (idle_sleep_.asleep())
+      wakeUp();
+    step_clock_.set(world_->SimTime());
+    odometry_scheduler_.restart(world_->SimTime());
+    clearCommand();
+    resetStepLog();
+    odom_transform_.setIdentity();
+    odometry_accumulator_.reset();
+    odometry_noise_.configure(odometry_noise_.parameters());
+    controller_.reset(0.0, 0.0, 0.0);
+  }
+
+  void GazeboRosForceBasedMove::clearCommand()
+  {
+    // Also drops whatever is waiting in the mailboxes, so a command sent
+    // before the reset does not take effect after it.
+    boost::mutex::scoped_lock scoped_lock(lock, boost::defer_lock);
+    if (lock_free_commands_) {
+      CommandMailbox::Command stale;
+      command_mailbox_.read(stale);
+    } else {
+      scoped_lock.lock();
+      new_command_ = false;
+    }
+    x_ = 0.0;
+    y_ = 0.0;
+    rot_ = 0.0;
+    last_cmd_vel_time_ = common::Time();
+    trajectory_mailbox_.read(trajectory_);
+    trajectory_.clear();
+  }
+
+  void GazeboRosForceBasedMove::reconfigureCallback(ridgeback_gazebo_plugins::ForceBasedMoveConfig& config,
+                                                    uint32_t level)
+  {
+    boost::mutex::scoped_lock scoped_lock(reconfigure_mutex_);
+    pending_config_ = config;
+    config_pending_.store(true, std::memory_order_release);
+  }
+
+  void GazeboRosForceBasedMove::applyPendingConfig(const common::Time& sim_time)
+  {
+    if (!config_pending_.load(std::memory_order_acquire))
+      return;
+    // Never wait on the service thread; a request that is being written
+    // is picked up on the next step instead.
+    boost::mutex::scoped_lock scoped_lock(reconfigure_mutex_, boost::try_to_lock);
+    if (!scoped_lock.owns_lock())
+      return;
+    config_pending_.store(false, std::memory_order_relaxed);
+
+    torque_yaw_velocity_p_gain_ = pending_config_.yaw_velocity_p_gain;
+    force_x_velocity_p_gain_ = pending_config_.x_velocity_p_gain;
+    force_y_velocity_p_gain_ = pending_config_.y_velocity_p_gain;
+    cmd_vel_time_out_ = pending_config_.cmd_vel_time_out;
+    if (pending_config_.odometry_rate != odometry_rate_) {
+      odometry_rate_ = pending_config_.odometry_rate;
+      odometry_scheduler_.setRate(odometry_rate_, sim_time);
+      selectSteps();
+    }
+  }
+
+  void GazeboRosForceBasedMove::appendStepLog(const StepLogFormat::Record& record)
+  {
+    if (!step_log_writer_.append(record)) {
+      ROS_ERROR("ForceBasedPlugin (ns = %s) step log full after %lu records, stopped recording",
+          robot_namespace_.c_str(), static_cast<unsigned long>(step_log_writer_.count()));
+      step_log_writer_.close();
+      step_log_mode_ = kStepLogOff;
+      selectSteps();
+    }
+  }
+
+  void GazeboRosForceBasedMove::recordCommand(const common::Time& sim_time)
+  {
+    // Only changes are logged; a replay holds each command until the next.
+    if (command_logged_ && x_ == logged_x_ && y_ == logged_y_ && rot_ == logged_rot_)
+      return;
+    StepLogFormat::Record record;
+    memset(&record, 0, sizeof(record));
+    record.stamp_ns = toNanoseconds(sim_time);
+    record.type = StepLogFormat::kCommand;
+    record.values[0] = x_;
+    record.values[1] = y_;
+    record.values[2] = rot_;
+    appendStepLog(record);
+    logged_x_ = x_;
+    logged_y_ = y_;
+    logged_rot_ = rot_;
+    command_logged_ = true;
+  }
+
+  void GazeboRosForceBasedMove::replayCommand(const common::Time& sim_time)
+  {
+    const int64_t now_ns = toNanoseconds(sim_time);
+    while (replay_command_cursor_ < step_log_reader_.count()) {
+      const StepLogFormat::Record& record = step_log_reader_[replay_command_cursor_];
+      if (record.type == StepLogFormat::kReset ||
+          (record.type == StepLogFormat::kCommand && record.stamp_ns > now_ns))
+        break;
+      if (record.type == StepLogFormat::kCommand) {
+        logged_x_ = record.values[0];
+        logged_y_ = record.values[1];
+        logged_rot_ = record.values[2];
+      }
+      ++replay_command_cursor_;
+    }
+    // The recorded command already had the timeout applied.
+    x_ = logged_x_;
+    y_ = logged_y_;
+    rot_ = logged_rot_;
+  }
+
+  void GazeboRosForceBasedMove::logOdometry(const OdometrySample& sample)
+  {
+    StepLogFormat::Record record;
+    memset(&record, 0, sizeof(record));
+    record.stamp_ns = sample.stamp.toNSec();
+    record.type = StepLogFormat::kOdometry;
+    record.values[0] = sample.transform.getOrigin().x();
+    record.values[1] = sample.transform.getOrigin().y();
+    record.values[2] = tf2::getYaw(sample.transform.getRotation());
+    record.values[3] = sample.linear_x;
+    record.values[4] = sample.linear_y;
+    record.values[5] = sample.angular_z;
+
+    // The rest of a step that filled up the recording still calls here.
+    if (step_log_mode_ == kStepLogOff)
+      return;
+    if (step_log_mode_ == kStepLogRecord) {
+      appendStepLog(record);
+      return;
+    }
+
+    // Replay: compare bit for bit with the recording of the same deadline.
+    const bool diverged = replay_mismatches_ > 0;
+    const size_t count = step_log_reader_.count();
+    const StepLogFormat::Record* expected = NULL;
+    while (replay_odometry_cursor_ < count) {
+      const StepLogFormat::Record& logged = step_log_reader_[replay_odometry_cursor_];
+      if (logged.type == StepLogFormat::kReset || logged.stamp_ns > record.stamp_ns)
+        break;
+      ++replay_odometry_cursor_;
+      if (logged.type != StepLogFormat::kOdometry)
+        continue;
+      if (logged.stamp_ns == record.stamp_ns) {
+        expected = &logged;
+        break;
+      }
+      ++replay_mismatches_;
+    }
+    if (!expected || memcmp(expected->values, record.values, sizeof(record.values)) != 0)
+      ++replay_mismatches_;
+    if (!diverged && replay_mismatches_ > 0) {
+      ROS_WARN("ForceBasedPlugin (ns = %s) replay diverged from the step log at %f s",
+          robot_namespace_.c_str(), record.stamp_ns * 1e-9);
+    }
+  }
+
+  void GazeboRosForceBasedMove::resetStepLog()
+  {
+    if (step_log_mode_ == kStepLogRecord) {
+      StepLogFormat::Record record;
+      memset(&record, 0, sizeof(record));
+      record.stamp_ns = step_clock_.nanoseconds();
+      record.type = StepLogFormat::kReset;
+      appendStepLog(record);
+    } else if (step_log_mode_ == kStepLogReplay) {
+      // Both cursors move on to the episode after the next reset.
+      const size_t count = step_log_reader_.count();
+      while (replay_command_cursor_ < count &&
+             step_log_reader_[replay_command_cursor_++].type != StepLogFormat::kReset) {}
+      while (replay_odometry_cursor_ < count &&
+             step_log_reader_[replay_odometry_cursor_++].type != StepLogFormat::kReset) {}
+      ROS_INFO("ForceBasedPlugin (ns = %s) replayed episode with %lu odometry mismatches",
+          robot_namespace_.c_str(), static_cast<unsigned long>(replay_mismatches_.load()));
+      replay_mismatches_ = 0;
+    }
+    logged_x_ = 0.0;
+    logged_y_ = 0.0;
+    logged_rot_ = 0.0;
+    command_logged_ = false;
+  }
+
+  void GazeboRosForceBasedMove::fallAsleep()
+  {
+    // Forces from this step would wake the bodies again right away.
+    parent_->ResetPhysicsStates();
+    parent_->SetEnabled(false);
+    idle_sleep_.sleep();
+    ROS_DEBUG("ForceBasedPlugin (ns = %s) asleep, %u robots sleeping, %u active",
+        robot_namespace_.c_str(), IdleSleep::sleepingRobots(), IdleSleep::activeRobots());
+  }
+
+  void GazeboRosForceBasedMove::wakeUp()
+  {
+    parent_->SetEnabled(true);
+    idle_sleep_.wake();
+    ROS_DEBUG("ForceBasedPlugin (ns = %s) awake, %u robots sleeping, %u active",
+        robot_namespace_.c_str(), IdleSleep::sleepingRobots(), IdleSleep::activeRobots());
+  }
+
+  bool GazeboRosForceBasedMove::applySnapshotAction(SnapshotHandoff::Action action)
+  {
+    if (action == SnapshotHandoff::kCapture) {
+      snapshot_.model.capture(parent_);
+      snapshot_.odom_transform = odom_transform_;
+      snapshot_.odometry_accumulator = odometry_accumulator_;
+      snapshot_.odometry_noise = odometry_noise_;
+      snapshot_.controller = controller_;
+      has_snapshot_ = true;
+      return true;
+    }
+
+    if (!has_snapshot_)
+      return false;
+    if (idle_sleep_.asleep())
+      wakeUp();
+    snapshot_.model.restore(parent_);
+    odom_transform_ = snapshot_.odom_transform;
+    odometry_accumulator_ = snapshot_.odometry_accumulator;
+    odometry_noise_ = snapshot_.odometry_noise;
+    controller_ = snapshot_.controller;
+    // Commands addressed the pre-restore episode.
+    clearCommand();
+    return true;
+  }
+
+  bool GazeboRosForceBasedMove::snapshotCallback(std_srvs::Trigger::Request& request,
+                                                 std_srvs::Trigger::Response& response)
+  {
+    response.success = snapshot_handoff_.request(SnapshotHandoff::kCapture, world_,
+        boost::bind(&GazeboRosForceBasedMove::applySnapshotAction, this, _1));
+    response.message = response.success ? "snapshot taken" : "shutting down";
+    return true;
+  }
+
+  bool GazeboRosForceBasedMove::restoreCallback(std_srvs::Trigger::Request& request,
+                                                std_srvs::Trigger::Response& response)
+  {
+    response.success = snapshot_handoff_.request(SnapshotHandoff::kRestore, world_,
+        boost::bind(&GazeboRosForceBasedMove::applySnapshotAction, this, _1));
+    response.message = response.success ? "snapshot restored" : "no snapshot taken yet";
+    return true;
+  }
+
+  void GazeboRosForceBasedMove::trajectoryCallback(
+      const trajectory_msgs::MultiDOFJointTrajectory::ConstPtr& trajectory_msg)
+  {
+    const common::Time sim_time = step_clock_.now();
+    trajectory_mailbox_.write(*trajectory_msg, ros::Time(sim_time.sec, sim_time.nsec));
   }
 
   void GazeboRosForceBasedMove::cmdVelCallback(
       const geometry_msgs::Twist::ConstPtr& cmd_msg)
   {
+    ScopedStepTimer callback_timer(profiling_ ? &cmd_vel_histogram_ : NULL);
+    const uint64_t received_ns = profiling_ ? profilerNow() : 0;
+
+    const int64_t now_ns = step_clock_.nanoseconds();
+    if (!command_input_.admit(cmd_msg->linear.x, cmd_msg->linear.y, cmd_msg->angular.z, now_ns))
+      return;
+    // Only admitted commands reach UpdateChild, so only they are timed.
+    if (profiling_)
+      last_cmd_received_ns_ = received_ns;
+
+    if (lock_free_commands_) {
+      CommandMailbox::Command cmd;
+      cmd.x = cmd_msg->linear.x;
+      cmd.y = cmd_msg->linear.y;
+      cmd.rot = cmd_msg->angular.z;
+      cmd.stamp = fromNanoseconds(now_ns);
+      command_mailbox_.write(cmd);
+      return;
+    }
+
+    const uint64_t wait_start = profiling_ ? profilerNow() : 0;
     boost::mutex::scoped_lock scoped_lock(lock);
+    if (profiling_)
+      mutex_wait_histogram_.record(profilerNow() - wait_start);
+    new_command_ = true;
     x_ = cmd_msg->linear.x;
     y_ = cmd_msg->linear.y;
     rot_ = cmd_msg->angular.z;
-    last_cmd_vel_time_= parent_->GetWorld()->SimTime();
+    last_cmd_vel_time_= fromNanoseconds(now_ns);
   }
 
   void GazeboRosForceBasedMove::QueueThread()
@@ -270,88 +1117,227 @@ namespace gazebo
     while (alive_ && rosnode_->ok())
     {
       queue_.callAvailable(ros::WallDuration(timeout));
+      ++queue_wakeups_;
     }
   }
 
-  void GazeboRosForceBasedMove::publishOdometry(double step_time)
+  void GazeboRosForceBasedMove::OdometryPublisherThread()
   {
+    uint64_t reported_drops = 0;
+    while (true)
+    {
+      odometry_samples_available_->wait();
+      if (!alive_)
+        break;
+
+      const uint64_t depth = odometry_samples_->read_available();
+      if (depth > async_max_queue_depth_)
+        async_max_queue_depth_ = depth;
+
+      OdometrySample sample;
+      if (!odometry_samples_->pop(sample))
+        continue;
+      (this->*publish_odometry_)(sample);
+      ++async_published_samples_;
+
+      const uint64_t drops = async_dropped_samples_;
+      if (drops != reported_drops) {
+        ROS_WARN_THROTTLE(1.0, "ForceBasedPlugin (ns = %s) async odometry queue full, "
+            "%lu samples dropped so far",
+            robot_namespace_.c_str(), static_cast<unsigned long>(drops));
+        reported_drops = drops;
+      }
+    }
+  }
 
-    ros::Time current_time = ros::Time::now();
-    std::string odom_frame = tf::resolve(tf_prefix_, odometry_frame_);
-    std::string base_footprint_frame =
-      tf::resolve(tf_prefix_, robot_base_frame_);
-
-    ignition::math::Vector3d angular_vel = parent_->RelativeAngularVel();
-    ignition::math::Vector3d linear_vel = parent_->RelativeLinearVel();
-
-    odom_transform_= odom_transform_ * this->getTransformForMotion(linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_time);
+  void GazeboRosForceBasedMove::publishDiagnostics(const ros::WallTimerEvent& event)
+  {
+    diagnostic_msgs::DiagnosticArray diagnostics;
+    diagnostics.header.stamp = ros::Time::now();
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = "ForceBasedMove: " + robot_namespace_;
+    status.hardware_id = robot_namespace_;
+    status.message = "Per-step timing";
+    appendSummary(status, "UpdateChild", update_histogram_.collect());
+    appendSummary(status, "publishOdometry", odometry_histogram_.collect());
+    appendSummary(status, "cmdVelCallback", cmd_vel_histogram_.collect());
+    appendSummary(status, "Mutex wait", mutex_wait_histogram_.collect());
+    appendSummary(status, "Command latency", command_latency_histogram_.collect());
+
+    diagnostic_msgs::KeyValue value;
+    value.key = "Odometry published";
+    value.value = boost::lexical_cast<std::string>(odometry_scheduler_.published());
+    status.values.push_back(value);
+    value.key = "Odometry deadlines skipped";
+    value.value = boost::lexical_cast<std::string>(odometry_scheduler_.skipped());
+    status.values.push_back(value);
+
+    value.key = "Commands received";
+    value.value = boost::lexical_cast<std::string>(command_input_.received());
+    status.values.push_back(value);
+    value.key = "Commands coalesced";
+    value.value = boost::lexical_cast<std::string>(command_input_.coalesced());
+    status.values.push_back(value);
+    value.key = "Commands dropped";
+    value.value = boost::lexical_cast<std::string>(command_input_.dropped());
+    status.values.push_back(value);
+
+    if (odometry_pool_) {
+      value.key = "Odometry pool exhausted";
+      value.value = boost::lexical_cast<std::string>(odometry_pool_->exhausted());
+      status.values.push_back(value);
+    }
 
-    tf::poseTFToMsg(odom_transform_, odom_.pose.pose);
-    odom_.twist.twist.angular.z = angular_vel.Z();
-    odom_.twist.twist.linear.x  = linear_vel.X();
-    odom_.twist.twist.linear.y = linear_vel.Y();
+    if (async_publish_) {
+      value.key = "Async odometry dropped";
+      value.value = boost::lexical_cast<std::string>(async_dropped_samples_.load());
+      status.values.push_back(value);
+      value.key = "Async odometry max queue depth";
+      value.value = boost::lexical_cast<std::string>(async_max_queue_depth_.load());
+      status.values.push_back(value);
+    }
 
-    odom_.header.stamp = current_time;
-    odom_.header.frame_id = odom_frame;
-    odom_.child_frame_id = base_footprint_frame;
+    if (step_log_mode_ == kStepLogRecord) {
+      value.key = "Step log records";
+      value.value = boost::lexical_cast<std::string>(step_log_writer_.count());
+      status.values.push_back(value);
+    } else if (step_log_mode_ == kStepLogReplay) {
+      value.key = "Replay odometry mismatches";
+      value.value = boost::lexical_cast<std::string>(replay_mismatches_.load());
+      status.values.push_back(value);
+    }
 
-    if (transform_broadcaster_.get()){
-      transform_broadcaster_->sendTransform(
-          tf::StampedTransform(odom_transform_, current_time, odom_frame,
-              base_footprint_frame));
+    if (idle_sleep_.enabled()) {
+      value.key = "Asleep";
+      value.value = idle_sleep_.asleep() ? "true" : "false";
+      status.values.push_back(value);
+      value.key = "Sleeping robots";
+      value.value = boost::lexical_cast<std::string>(IdleSleep::sleepingRobots());
+      status.values.push_back(value);
+      value.key = "Active robots";
+      value.value = boost::lexical_cast<std::string>(IdleSleep::activeRobots());
+      status.values.push_back(value);
     }
 
-    odom_.pose.covariance[0] = 0.001;
-    odom_.pose.covariance[7] = 0.001;
-    odom_.pose.covariance[14] = 1000000000000.0;
-    odom_.pose.covariance[21] = 1000000000000.0;
-    odom_.pose.covariance[28] = 1000000000000.0;
+    diagnostics.status.push_back(status);
+    diagnostics_pub_.publish(diagnostics);
+  }
 
-    if (std::abs(angular_vel.Z()) < 0.0001) {
-      odom_.pose.covariance[35] = 0.01;
-    }else{
-      odom_.pose.covariance[35] = 100.0;
+  template <GazeboRosForceBasedMove::OdometrySource Source>
+  GazeboRosForceBasedMove::OdometrySample GazeboRosForceBasedMove::sampleOdometry(double step_time,
+                                                                                 const ros::Time& stamp,
+                                                                                 bool last_of_step)
+  {
+    ignition::math::Vector3d angular_vel = parent_->RelativeAngularVel();
+    ignition::math::Vector3d linear_vel = parent_->RelativeLinearVel();
+
+    OdometrySample sample;
+    sample.stamp = stamp;
+    sample.linear_x = linear_vel.X();
+    sample.linear_y = linear_vel.Y();
+    sample.angular_z = angular_vel.Z();
+
+    if (Source == kGroundTruthOdometry) {
+      // Pose relative to where the model was loaded, so it starts at the
+      // odom origin like the integrated estimate.
+      const ignition::math::Pose3d pose = parent_->WorldPose();
+      ignition::math::Vector3d position =
+        spawn_pose_.Rot().RotateVectorReverse(pose.Pos() - spawn_pose_.Pos());
+      ignition::math::Quaterniond orientation = spawn_pose_.Rot().Inverse() * pose.Rot();
+
+      const Se2Delta error = odometry_noise_.sample(step_time);
+      if (odometry_noise_.enabled()) {
+        const ignition::math::Quaterniond error_rotation(0.0, 0.0, error.yaw);
+        position = error_rotation.RotateVector(position) + ignition::math::Vector3d(error.x, error.y, 0.0);
+        orientation = error_rotation * orientation;
+      }
+      odom_transform_.setRotation(tf2::Quaternion(orientation.X(), orientation.Y(), orientation.Z(),
+                                                  orientation.W()));
+      odom_transform_.setOrigin(tf2::Vector3(position.X(), position.Y(), position.Z()));
+    } else {
+      Se2Delta motion;
+      if (Source == kAccumulatedOdometry) {
+        // Everything accumulated since the last message goes out with the
+        // latest deadline of this step; earlier batched ones carry no motion.
+        if (last_of_step)
+          motion = odometry_accumulator_.take();
+      } else if (Source == kFirstOrderOdometry) {
+        motion = integrateTwistFirstOrder(sample.linear_x, sample.linear_y, sample.angular_z, step_time);
+      } else {
+        motion = integrateTwist(sample.linear_x, sample.linear_y, sample.angular_z, step_time);
+      }
+      odom_transform_ = odom_transform_ * this->getTransformForMotion(motion);
     }
+    sample.transform = odom_transform_;
+    return sample;
+  }
 
-    odom_.twist.covariance[0] = 0.001;
-    odom_.twist.covariance[7] = 0.001;
-    odom_.twist.covariance[14] = 0.001;
-    odom_.twist.covariance[21] = 1000000000000.0;
-    odom_.twist.covariance[28] = 1000000000000.0;
+  template <GazeboRosForceBasedMove::TfPolicy Tf, bool kPooled, bool kProfiling>
+  void GazeboRosForceBasedMove::publishOdometry(const OdometrySample& sample)
+  {
+    ScopedStepTimer odometry_timer(kProfiling ? &odometry_histogram_ : NULL);
 
-    if (std::abs(angular_vel.Z()) < 0.0001) {
-      odom_.twist.covariance[35] = 0.01;
-    }else{
-      odom_.twist.covariance[35] = 100.0;
-    }
+#ifdef RIDGEBACK_GAZEBO_PLUGINS_COUNT_ALLOCATIONS
+    AllocationCounter allocations;
+#endif
 
+    const ros::Time& current_time = sample.stamp;
 
+    tf2::toMsg(sample.transform, odom_.pose.pose);
+    odom_.twist.twist.angular.z = sample.angular_z;
+    odom_.twist.twist.linear.x  = sample.linear_x;
+    odom_.twist.twist.linear.y = sample.linear_y;
 
-    odometry_pub_.publish(odom_);
-  }
+    odom_.header.stamp = current_time;
 
+    // Frame ids and the constant covariance entries are filled in by Load().
+    const double yaw_covariance = (std::abs(sample.angular_z) < 0.0001) ? 0.01 : 100.0;
+    odom_.pose.covariance[35] = yaw_covariance;
+    odom_.twist.covariance[35] = yaw_covariance;
+
+    if (Tf != kNoTf) {
+      odom_stamped_transform_.header.stamp = current_time;
+      odom_stamped_transform_.transform.translation.x = odom_.pose.pose.position.x;
+      odom_stamped_transform_.transform.translation.y = odom_.pose.pose.position.y;
+      odom_stamped_transform_.transform.translation.z = odom_.pose.pose.position.z;
+      odom_stamped_transform_.transform.rotation = odom_.pose.pose.orientation;
+    }
 
-  tf::Transform GazeboRosForceBasedMove::getTransformForMotion(double linear_vel_x, double linear_vel_y, double angular_vel, double timeSeconds) const
-  {
-    tf::Transform tmp;
-    tmp.setIdentity();
+#ifdef RIDGEBACK_GAZEBO_PLUGINS_COUNT_ALLOCATIONS
+    // Everything above is ours; the broadcaster and publisher allocate
+    // internally when they serialize.
+    if (allocations.count() > 0) {
+      ROS_WARN_THROTTLE(1.0, "ForceBasedPlugin (ns = %s) odometry path made %lu heap allocations",
+          robot_namespace_.c_str(), static_cast<unsigned long>(allocations.count()));
+    }
+#endif
 
-    const double linear_x = linear_vel_x * timeSeconds;
-    const double linear_y = linear_vel_y * timeSeconds;
-    const double angular = angular_vel * timeSeconds;
+    if (Tf == kBatchedTf) {
+      tf_batcher_->add(odom_stamped_transform_);
+    } else if (Tf == kBroadcastTf) {
+      transform_broadcaster_->sendTransform(odom_stamped_transform_);
+    }
 
-    if (std::abs(angular_vel) < 0.0001) {
-      //Drive straight
-      tmp.setOrigin(tf::Vector3(static_cast<double>(linear_x), 0.0, 0.0));
+    if (kPooled) {
+      // Only the fields that change; the rest came from the prototype.
+      OdometryPool::Ptr odom = odometry_pool_->acquire();
+      odom->header.stamp = odom_.header.stamp;
+      odom->pose = odom_.pose;
+      odom->twist = odom_.twist;
+      odometry_pub_.publish(odom);
     } else {
-      const double delta_x = linear_x*cos(angular) - linear_y*sin(angular);
-      const double delta_y = linear_x*sin(angular) + linear_y*cos(angular);        
-
-      tmp.setOrigin(tf::Vector3(delta_x, delta_y, 0.0));
-      tmp.setRotation(tf::createQuaternionFromYaw(angular));
+      odometry_pub_.publish(odom_);
     }
+  }
+
 
-    return tmp;
+  tf2::Transform GazeboRosForceBasedMove::getTransformForMotion(const Se2Delta& motion) const
+  {
+    tf2::Quaternion rotation;
+    rotation.setRPY(0.0, 0.0, motion.yaw);
+    return tf2::Transform(rotation, tf2::Vector3(motion.x, motion.y, 0.0));
   }
 
   GZ_REGISTER_MODEL_PLUGIN(GazeboRosForceBasedMove)
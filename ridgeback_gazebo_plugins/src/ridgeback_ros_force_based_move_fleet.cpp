@@ -0,0 +1,815 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: World plugin running the force based move controller for every
+ *       Ridgeback in the world from a single update callback.
+ */
+
+#include <ridgeback_gazebo_plugins/ridgeback_ros_force_based_move_fleet.h>
+#include <ridgeback_gazebo_plugins/tf_prefix.h>
+
+namespace gazebo
+{
+
+  GazeboRosForceBasedMoveFleet::GazeboRosForceBasedMoveFleet()
+    : known_model_count_(0), models_changed_(false), alive_(false), has_snapshot_(false),
+      diagnostics_period_(0.0), update_count_(0) {}
+
+  GazeboRosForceBasedMoveFleet::~GazeboRosForceBasedMoveFleet()
+  {
+    add_entity_connection_.reset();
+    delete_entity_connection_.reset();
+    alive_ = false;
+    queue_.clear();
+    queue_.disable();
+    if (rosnode_)
+      rosnode_->shutdown();
+    if (callback_queue_thread_.joinable())
+      callback_queue_thread_.join();
+  }
+
+  // Load the controller
+  void GazeboRosForceBasedMoveFleet::Load(physics::WorldPtr world,
+      sdf::ElementPtr sdf)
+  {
+    world_ = world;
+
+    /* Parse parameters */
+
+    model_prefix_ = "ridgeback";
+    if (!sdf->HasElement("modelPrefix"))
+    {
+      ROS_WARN("ForceBasedFleetPlugin missing <modelPrefix>, "
+          "defaults to \"%s\"", model_prefix_.c_str());
+    }
+    else
+    {
+      model_prefix_ = sdf->GetElement("modelPrefix")->Get<std::string>();
+    }
+
+    command_topic_ = "cmd_vel";
+    if (sdf->HasElement("commandTopic"))
+      command_topic_ = sdf->GetElement("commandTopic")->Get<std::string>();
+
+    command_trajectory_topic_ = "cmd_vel_trajectory";
+    if (sdf->HasElement("commandTrajectoryTopic"))
+      command_trajectory_topic_ = sdf->GetElement("commandTrajectoryTopic")->Get<std::string>();
+
+    odometry_topic_ = "odom";
+    if (sdf->HasElement("odometryTopic"))
+      odometry_topic_ = sdf->GetElement("odometryTopic")->Get<std::string>();
+
+    odometry_frame_ = "odom";
+    if (sdf->HasElement("odometryFrame"))
+      odometry_frame_ = sdf->GetElement("odometryFrame")->Get<std::string>();
+
+    robot_base_frame_ = "base_footprint";
+    if (sdf->HasElement("robotBaseFrame"))
+      robot_base_frame_ = sdf->GetElement("robotBaseFrame")->Get<std::string>();
+
+    default_torque_yaw_velocity_p_gain_ = 100.0;
+    default_force_x_velocity_p_gain_ = 10000.0;
+    default_force_y_velocity_p_gain_ = 10000.0;
+
+    if (sdf->HasElement("yaw_velocity_p_gain"))
+      (sdf->GetElement("yaw_velocity_p_gain")->GetValue()->Get(default_torque_yaw_velocity_p_gain_));
+
+    if (sdf->HasElement("x_velocity_p_gain"))
+      (sdf->GetElement("x_velocity_p_gain")->GetValue()->Get(default_force_x_velocity_p_gain_));
+
+    if (sdf->HasElement("y_velocity_p_gain"))
+      (sdf->GetElement("y_velocity_p_gain")->GetValue()->Get(default_force_y_velocity_p_gain_));
+
+    odometry_rate_ = 20.0;
+    if (sdf->HasElement("odometryRate"))
+      odometry_rate_ = sdf->GetElement("odometryRate")->Get<double>();
+
+    cmd_vel_time_out_ = 0.25;
+    if (sdf->HasElement("cmdVelTimeOut"))
+      cmd_vel_time_out_ = sdf->GetElement("cmdVelTimeOut")->Get<double>();
+
+    publish_odometry_tf_ = true;
+    if (sdf->HasElement("publishOdometryTf"))
+      publish_odometry_tf_ = sdf->GetElement("publishOdometryTf")->Get<bool>();
+
+    bool batch_tf = false;
+    if (sdf->HasElement("batchTf"))
+      batch_tf = sdf->GetElement("batchTf")->Get<bool>();
+
+    kinematic_ = false;
+    if (sdf->HasElement("mode")) {
+      std::string mode = sdf->GetElement("mode")->Get<std::string>();
+      if (mode == "kinematic") {
+        kinematic_ = true;
+      } else if (mode != "dynamic") {
+        ROS_WARN("ForceBasedFleetPlugin: unknown <mode> \"%s\", defaults to \"dynamic\"", mode.c_str());
+      }
+    }
+
+    kinematic_floating_ = kinematic_ && sdf->HasElement("kinematicWheelCollisions") &&
+                          !sdf->GetElement("kinematicWheelCollisions")->Get<bool>();
+
+    feed_forward_control_ = false;
+    if (sdf->HasElement("controllerMode")) {
+      std::string mode = sdf->GetElement("controllerMode")->Get<std::string>();
+      if (mode == "feed_forward") {
+        feed_forward_control_ = true;
+        controller_parameters_ = feedForwardParameters(sdf);
+      } else if (mode != "p") {
+        ROS_WARN("ForceBasedFleetPlugin: unknown <controllerMode> \"%s\", defaults to \"p\"",
+            mode.c_str());
+      }
+    }
+
+    zero_copy_pool_size_ = 0;
+    if (sdf->HasElement("zeroCopyOdometry") && sdf->GetElement("zeroCopyOdometry")->Get<bool>()) {
+      zero_copy_pool_size_ = 8;
+      if (sdf->HasElement("zeroCopyPoolSize"))
+        zero_copy_pool_size_ = sdf->GetElement("zeroCopyPoolSize")->Get<unsigned int>();
+    }
+
+    unsigned int odometry_max_batch = 1;
+    if (sdf->HasElement("odometryCatchUp")) {
+      std::string catch_up = sdf->GetElement("odometryCatchUp")->Get<std::string>();
+      if (catch_up == "batch") {
+        odometry_max_batch = 5;
+        if (sdf->HasElement("odometryMaxBatch"))
+          odometry_max_batch = sdf->GetElement("odometryMaxBatch")->Get<unsigned int>();
+      } else if (catch_up != "skip") {
+        ROS_WARN("ForceBasedFleetPlugin: unknown <odometryCatchUp> \"%s\", defaults to \"skip\"",
+            catch_up.c_str());
+      }
+    }
+
+    first_order_odometry_ = false;
+    if (sdf->HasElement("odometryIntegrator")) {
+      std::string integrator = sdf->GetElement("odometryIntegrator")->Get<std::string>();
+      if (integrator == "first_order") {
+        first_order_odometry_ = true;
+      } else if (integrator != "exact") {
+        ROS_WARN("ForceBasedFleetPlugin: unknown <odometryIntegrator> \"%s\", defaults to \"exact\"",
+            integrator.c_str());
+      }
+    }
+
+    per_step_odometry_ = false;
+    if (sdf->HasElement("odometryPerStep"))
+      per_step_odometry_ = sdf->GetElement("odometryPerStep")->Get<bool>();
+    physics_step_size_ = world_->Physics()->GetMaxStepSize();
+
+    ground_truth_odometry_ = false;
+    if (sdf->HasElement("odometrySource")) {
+      std::string source = sdf->GetElement("odometrySource")->Get<std::string>();
+      if (source == "ground_truth") {
+        ground_truth_odometry_ = true;
+        per_step_odometry_ = false;
+      } else if (source != "integrated") {
+        ROS_WARN("ForceBasedFleetPlugin: unknown <odometrySource> \"%s\", defaults to \"integrated\"",
+            source.c_str());
+      }
+    }
+
+    if (sdf->HasElement("odometryPositionNoise"))
+      noise_parameters_.position_stddev = sdf->GetElement("odometryPositionNoise")->Get<double>();
+    if (sdf->HasElement("odometryYawNoise"))
+      noise_parameters_.yaw_stddev = sdf->GetElement("odometryYawNoise")->Get<double>();
+    if (sdf->HasElement("odometryPositionDrift"))
+      noise_parameters_.position_drift = sdf->GetElement("odometryPositionDrift")->Get<double>();
+    if (sdf->HasElement("odometryYawDrift"))
+      noise_parameters_.yaw_drift = sdf->GetElement("odometryYawDrift")->Get<double>();
+    if (sdf->HasElement("odometryNoiseSeed"))
+      noise_parameters_.seed = sdf->GetElement("odometryNoiseSeed")->Get<unsigned int>();
+
+    sleep_parameters_ = IdleSleep::parameters(sdf);
+
+    double diagnostics_rate = 0.1;
+    if (sdf->HasElement("diagnosticsRate"))
+      diagnostics_rate = sdf->GetElement("diagnosticsRate")->Get<double>();
+    diagnostics_period_ = diagnostics_rate > 0.0 ? 1.0 / diagnostics_rate : 0.0;
+
+    step_clock_.set(world_->SimTime());
+    odometry_scheduler_.configure(odometry_rate_, world_->SimTime(), odometry_max_batch);
+
+    // Ensure that ROS has been initialized
+    if (!ros::isInitialized())
+    {
+      ROS_FATAL_STREAM("ForceBasedFleetPlugin: A ROS node for Gazebo has not been initialized, "
+        << "unable to load plugin. Load the Gazebo system plugin "
+        << "'libgazebo_ros_api_plugin.so' in the gazebo_ros package)");
+      return;
+    }
+    rosnode_.reset(new ros::NodeHandle());
+    rosnode_->setCallbackQueue(&queue_);
+
+    // One broadcaster for the whole fleet; all transforms of a tick go out
+    // in a single tf message. <batchTf> also merges them with any
+    // GazeboRosForceBasedMove instances in the same gzserver.
+    if (publish_odometry_tf_) {
+      if (batch_tf)
+        tf_batcher_ = TfBatcher::acquire();
+      else
+        transform_broadcaster_.reset(new tf2_ros::TransformBroadcaster());
+    }
+
+    alive_ = true;
+    callback_queue_thread_ =
+      boost::thread(boost::bind(&GazeboRosForceBasedMoveFleet::QueueThread, this));
+
+    // Episode reset without reloading the world, see GazeboRosForceBasedMove.
+    ros::AdvertiseServiceOptions snapshot_so =
+      ros::AdvertiseServiceOptions::create<std_srvs::Trigger>("snapshot_state",
+          boost::bind(&GazeboRosForceBasedMoveFleet::snapshotCallback, this, _1, _2),
+          ros::VoidPtr(), &queue_);
+    snapshot_srv_ = rosnode_->advertiseService(snapshot_so);
+    ros::AdvertiseServiceOptions restore_so =
+      ros::AdvertiseServiceOptions::create<std_srvs::Trigger>("restore_state",
+          boost::bind(&GazeboRosForceBasedMoveFleet::restoreCallback, this, _1, _2),
+          ros::VoidPtr(), &queue_);
+    restore_srv_ = rosnode_->advertiseService(restore_so);
+
+    if (diagnostics_period_ > 0.0)
+      diagnostics_pub_ = rosnode_->advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+    last_timing_report_ = ros::WallTime::now();
+
+    ROS_INFO("ForceBasedFleetPlugin managing models prefixed with \"%s\"", model_prefix_.c_str());
+
+    add_entity_connection_ = event::Events::ConnectAddEntity(
+        boost::bind(&GazeboRosForceBasedMoveFleet::markModelsChanged, this));
+    delete_entity_connection_ = event::Events::ConnectDeleteEntity(
+        boost::bind(&GazeboRosForceBasedMoveFleet::markModelsChanged, this));
+
+    // listen to the update event (broadcast every simulation iteration)
+    update_connection_ =
+      event::Events::ConnectWorldUpdateBegin(
+          boost::bind(&GazeboRosForceBasedMoveFleet::UpdateChild, this));
+  }
+
+  void GazeboRosForceBasedMoveFleet::markModelsChanged()
+  {
+    models_changed_ = true;
+  }
+
+  void GazeboRosForceBasedMoveFleet::refreshRobots()
+  {
+    // A model respawned under the same name is a new robot.
+    for (size_t i = models_.size(); i > 0; --i)
+    {
+      if (world_->ModelByName(models_[i - 1]->GetName()) != models_[i - 1])
+        removeRobot(i - 1);
+    }
+
+    physics::Model_V models = world_->Models();
+    for (physics::Model_V::const_iterator it = models.begin(); it != models.end(); ++it)
+    {
+      const std::string& name = (*it)->GetName();
+      if (name.compare(0, model_prefix_.size(), model_prefix_) != 0)
+        continue;
+      if (std::find(models_.begin(), models_.end(), *it) != models_.end())
+        continue;
+      addRobot(*it);
+    }
+
+    known_model_count_ = world_->ModelCount();
+  }
+
+  void GazeboRosForceBasedMoveFleet::addRobot(const physics::ModelPtr& model)
+  {
+    physics::LinkPtr link = model->GetLink(robot_base_frame_);
+    if (!link)
+    {
+      ROS_WARN("ForceBasedFleetPlugin: model %s has no link %s, not managing it",
+          model->GetName().c_str(), robot_base_frame_.c_str());
+      return;
+    }
+
+    if (kinematic_floating_) {
+      const physics::Link_V& model_links = model->GetLinks();
+      for (physics::Link_V::const_iterator it = model_links.begin(); it != model_links.end(); ++it) {
+        if (*it != link)
+          (*it)->SetCollideMode("none");
+      }
+      model->SetGravityMode(false);
+    }
+
+    const std::string& ns = model->GetName();
+    boost::shared_ptr<CommandMailbox> mailbox(new CommandMailbox());
+
+    ros::SubscribeOptions so =
+      ros::SubscribeOptions::create<geometry_msgs::Twist>(ns + "/" + command_topic_, 1,
+          boost::bind(&GazeboRosForceBasedMoveFleet::cmdVelCallback, this, _1, mailbox),
+          ros::VoidPtr(), &queue_);
+
+    boost::shared_ptr<TrajectoryMailbox> trajectory_mailbox(new TrajectoryMailbox());
+    ros::Subscriber trajectory_sub;
+    if (!command_trajectory_topic_.empty()) {
+      ros::SubscribeOptions trajectory_so =
+        ros::SubscribeOptions::create<trajectory_msgs::MultiDOFJointTrajectory>(
+            ns + "/" + command_trajectory_topic_, 1,
+            boost::bind(&GazeboRosForceBasedMoveFleet::trajectoryCallback, this, _1, trajectory_mailbox),
+            ros::VoidPtr(), &queue_);
+      trajectory_sub = rosnode_->subscribe(trajectory_so);
+    }
+
+    models_.push_back(model);
+    links_.push_back(link);
+    mailboxes_.push_back(mailbox);
+    cmd_x_.push_back(0.0);
+    cmd_y_.push_back(0.0);
+    cmd_rot_.push_back(0.0);
+    cmd_time_.push_back(common::Time());
+    // Same names as the model plugin's dynamic_reconfigure parameters.
+    const std::string gains = ns + "/force_based_move/";
+    double yaw_gain, x_gain, y_gain;
+    rosnode_->param(gains + "yaw_velocity_p_gain", yaw_gain, default_torque_yaw_velocity_p_gain_);
+    rosnode_->param(gains + "x_velocity_p_gain", x_gain, default_force_x_velocity_p_gain_);
+    rosnode_->param(gains + "y_velocity_p_gain", y_gain, default_force_y_velocity_p_gain_);
+    torque_yaw_velocity_p_gain_.push_back(yaw_gain);
+    force_x_velocity_p_gain_.push_back(x_gain);
+    force_y_velocity_p_gain_.push_back(y_gain);
+    odom_x_.push_back(0.0);
+    odom_y_.push_back(0.0);
+    odom_yaw_.push_back(0.0);
+    odom_accumulators_.push_back(Se2Accumulator());
+    controllers_.push_back(FeedForwardController());
+    if (feed_forward_control_) {
+      FeedForwardController::Parameters controller = controller_parameters_;
+      modelInertia(model, link, controller.mass, controller.yaw_inertia);
+      controllers_.back().configure(controller);
+    }
+    spawn_poses_.push_back(model->WorldPose());
+    OdometryNoise::Parameters noise = noise_parameters_;
+    noise.seed = OdometryNoise::seedFor(noise_parameters_.seed, model->GetScopedName());
+    odom_noises_.push_back(OdometryNoise());
+    odom_noises_.back().configure(noise);
+    idle_sleeps_.push_back(IdleSleep());
+    idle_sleeps_.back().configure(sleep_parameters_);
+
+    nav_msgs::Odometry odom;
+    odom.header.frame_id = resolveFrame(ns, odometry_frame_);
+    odom.child_frame_id = resolveFrame(ns, robot_base_frame_);
+    odom.pose.covariance[0] = 0.001;
+    odom.pose.covariance[7] = 0.001;
+    odom.pose.covariance[14] = 1000000000000.0;
+    odom.pose.covariance[21] = 1000000000000.0;
+    odom.pose.covariance[28] = 1000000000000.0;
+    odom.twist.covariance[0] = 0.001;
+    odom.twist.covariance[7] = 0.001;
+    odom.twist.covariance[14] = 0.001;
+    odom.twist.covariance[21] = 1000000000000.0;
+    odom.twist.covariance[28] = 1000000000000.0;
+    odom_msgs_.push_back(odom);
+    odometry_pools_.push_back(zero_copy_pool_size_ > 0 ?
+        boost::shared_ptr<OdometryPool>(new OdometryPool(zero_copy_pool_size_, odom)) :
+        boost::shared_ptr<OdometryPool>());
+
+    geometry_msgs::TransformStamped odom_transform;
+    odom_transform.header.frame_id = odom.header.frame_id;
+    odom_transform.child_frame_id = odom.child_frame_id;
+    odom_transform.transform.rotation.w = 1.0;
+    odom_transforms_.push_back(odom_transform);
+
+    vel_subs_.push_back(rosnode_->subscribe(so));
+    trajectory_mailboxes_.push_back(trajectory_mailbox);
+    trajectories_.push_back(VelocityTrajectory());
+    trajectory_subs_.push_back(trajectory_sub);
+    odometry_pubs_.push_back(rosnode_->advertise<nav_msgs::Odometry>(ns + "/" + odometry_topic_, 1));
+
+    ROS_INFO("ForceBasedFleetPlugin now managing %s (%lu robots), P gains x %f y %f yaw %f",
+        ns.c_str(), static_cast<unsigned long>(models_.size()), x_gain, y_gain, yaw_gain);
+  }
+
+  void GazeboRosForceBasedMoveFleet::removeRobot(size_t index)
+  {
+    ROS_INFO("ForceBasedFleetPlugin releasing %s", models_[index]->GetName().c_str());
+
+    vel_subs_[index].shutdown();
+    trajectory_subs_[index].shutdown();
+    odometry_pubs_[index].shutdown();
+
+    models_.erase(models_.begin() + index);
+    links_.erase(links_.begin() + index);
+    mailboxes_.erase(mailboxes_.begin() + index);
+    cmd_x_.erase(cmd_x_.begin() + index);
+    cmd_y_.erase(cmd_y_.begin() + index);
+    cmd_rot_.erase(cmd_rot_.begin() + index);
+    cmd_time_.erase(cmd_time_.begin() + index);
+    torque_yaw_velocity_p_gain_.erase(torque_yaw_velocity_p_gain_.begin() + index);
+    force_x_velocity_p_gain_.erase(force_x_velocity_p_gain_.begin() + index);
+    force_y_velocity_p_gain_.erase(force_y_velocity_p_gain_.begin() + index);
+    odom_x_.erase(odom_x_.begin() + index);
+    odom_y_.erase(odom_y_.begin() + index);
+    odom_yaw_.erase(odom_yaw_.begin() + index);
+    odom_accumulators_.erase(odom_accumulators_.begin() + index);
+    controllers_.erase(controllers_.begin() + index);
+    spawn_poses_.erase(spawn_poses_.begin() + index);
+    odom_noises_.erase(odom_noises_.begin() + index);
+    idle_sleeps_.erase(idle_sleeps_.begin() + index);
+    odom_msgs_.erase(odom_msgs_.begin() + index);
+    odom_transforms_.erase(odom_transforms_.begin() + index);
+    vel_subs_.erase(vel_subs_.begin() + index);
+    trajectory_mailboxes_.erase(trajectory_mailboxes_.begin() + index);
+    trajectories_.erase(trajectories_.begin() + index);
+    trajectory_subs_.erase(trajectory_subs_.begin() + index);
+    odometry_pubs_.erase(odometry_pubs_.begin() + index);
+    odometry_pools_.erase(odometry_pools_.begin() + index);
+  }
+
+  // Update the controllers of all managed robots
+  void GazeboRosForceBasedMoveFleet::UpdateChild()
+  {
+    if (models_changed_.exchange(false) || world_->ModelCount() != known_model_count_)
+      refreshRobots();
+
+    const ros::WallTime update_start = ros::WallTime::now();
+    const common::Time current_time = world_->SimTime();
+    step_clock_.set(current_time);
+    snapshot_handoff_.poll(boost::bind(&GazeboRosForceBasedMoveFleet::applySnapshotAction, this, _1));
+    const int64_t now_ns = toNanoseconds(current_time);
+    const int64_t time_out_ns = static_cast<int64_t>(cmd_vel_time_out_ * 1e9);
+    const size_t count = models_.size();
+    // As simulated, rather than the step size read at Load(): the world's
+    // max_step_size can be changed while it runs.
+    const double step_size = step_clock_.stepSize() > 0.0 ? step_clock_.stepSize() : physics_step_size_;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      CommandMailbox::Command cmd;
+      if (mailboxes_[i]->read(cmd)) {
+        cmd_x_[i] = cmd.x;
+        cmd_y_[i] = cmd.y;
+        cmd_rot_[i] = cmd.rot;
+        cmd_time_[i] = cmd.stamp;
+        trajectories_[i].clear();
+      }
+
+      if ((current_time - cmd_time_[i]) > cmd_vel_time_out_) {
+        cmd_x_[i] = 0.0;
+        cmd_y_[i] = 0.0;
+        cmd_rot_[i] = 0.0;
+      }
+
+      trajectory_mailboxes_[i]->read(trajectories_[i]);
+      if (!trajectories_[i].empty()) {
+        if (now_ns - trajectories_[i].endStamp() > time_out_ns)
+          trajectories_[i].clear();
+        else
+          trajectories_[i].sample(now_ns, cmd_x_[i], cmd_y_[i], cmd_rot_[i]);
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      // A sleeping robot wakes on a command, or when ODE has re-enabled it
+      // because an enabled body touched it.
+      const bool commanded = cmd_x_[i] != 0.0 || cmd_y_[i] != 0.0 || cmd_rot_[i] != 0.0;
+      if (idle_sleeps_[i].asleep()) {
+        if (!commanded && !links_[i]->GetEnabled())
+          continue;
+        wakeUp(i);
+      }
+
+      const ignition::math::Vector3d angular_vel = models_[i]->WorldAngularVel();
+      const ignition::math::Vector3d linear_vel = models_[i]->RelativeLinearVel();
+
+      if (kinematic_) {
+        const double yaw = models_[i]->WorldPose().Rot().Yaw();
+        const double cos_yaw = cos(yaw);
+        const double sin_yaw = sin(yaw);
+        models_[i]->SetLinearVel(ignition::math::Vector3d(
+              cmd_x_[i] * cos_yaw - cmd_y_[i] * sin_yaw,
+              cmd_y_[i] * cos_yaw + cmd_x_[i] * sin_yaw,
+              kinematic_floating_ ? 0.0 : models_[i]->WorldLinearVel().Z()));
+        models_[i]->SetAngularVel(ignition::math::Vector3d(0.0, 0.0, cmd_rot_[i]));
+      } else if (feed_forward_control_) {
+        double force_x, force_y, torque_z;
+        controllers_[i].update(cmd_x_[i], cmd_y_[i], cmd_rot_[i],
+                               linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_size,
+                               force_x, force_y, torque_z);
+        links_[i]->AddTorque(ignition::math::Vector3d(0.0, 0.0, torque_z));
+        links_[i]->AddRelativeForce(ignition::math::Vector3d(force_x, force_y, 0.0));
+      } else {
+        links_[i]->AddTorque(ignition::math::Vector3d(0.0,
+                                         0.0,
+                                         (cmd_rot_[i] - angular_vel.Z()) * torque_yaw_velocity_p_gain_[i]));
+        links_[i]->AddRelativeForce(ignition::math::Vector3d((cmd_x_[i] - linear_vel.X()) * force_x_velocity_p_gain_[i],
+                                                  (cmd_y_[i] - linear_vel.Y()) * force_y_velocity_p_gain_[i],
+                                                  0.0));
+      }
+      if (per_step_odometry_)
+        odom_accumulators_[i].add(linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_size);
+
+      if (idle_sleeps_[i].update(commanded, hypot(linear_vel.X(), linear_vel.Y()), angular_vel.Z(),
+                                 step_size))
+        fallAsleep(i);
+    }
+
+    if (odometry_scheduler_.enabled()) {
+      const unsigned int due = odometry_scheduler_.poll(current_time);
+      for (unsigned int d = 0; d < due; ++d) {
+        const common::Time sim_stamp = odometry_scheduler_.stamp(d);
+        const ros::Time stamp(sim_stamp.sec, sim_stamp.nsec);
+        const double step_time = odometry_scheduler_.stepTime(d);
+        for (size_t i = 0; i < count; ++i)
+          publishOdometry(i, step_time, stamp, d + 1 == due);
+        if (tf_batcher_) {
+          for (size_t i = 0; i < count; ++i)
+            tf_batcher_->add(odom_transforms_[i]);
+        } else if (transform_broadcaster_ && count > 0) {
+          transform_broadcaster_->sendTransform(odom_transforms_);
+        }
+      }
+    }
+
+    update_time_ += ros::WallTime::now() - update_start;
+    ++update_count_;
+    if (diagnostics_period_ > 0.0 && (update_start - last_timing_report_).toSec() > diagnostics_period_) {
+      size_t sleeping = 0;
+      for (size_t i = 0; i < count; ++i)
+        sleeping += idle_sleeps_[i].asleep() ? 1 : 0;
+      const double update_us = update_count_ > 0 ? update_time_.toSec() * 1e6 / update_count_ : 0.0;
+      ROS_DEBUG("ForceBasedFleetPlugin: %lu robots (%lu sleeping), %.2f us per update",
+          static_cast<unsigned long>(count), static_cast<unsigned long>(sleeping), update_us);
+      publishDiagnostics(sleeping, update_us);
+      update_time_ = ros::WallDuration();
+      update_count_ = 0;
+      last_timing_report_ = update_start;
+    }
+  }
+
+  void GazeboRosForceBasedMoveFleet::publishDiagnostics(size_t sleeping, double update_us)
+  {
+    diagnostic_msgs::DiagnosticArray diagnostics;
+    diagnostics.header.stamp = ros::Time::now();
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = "ForceBasedMoveFleet: " + model_prefix_;
+    status.hardware_id = world_->Name();
+    status.message = "Per-step timing";
+
+    // The UpdateChild keys match GazeboRosForceBasedMove, so the benchmark
+    // scripts read both.
+    const size_t robots = models_.size();
+    diagnostic_msgs::KeyValue value;
+    value.key = "UpdateChild count";
+    value.value = boost::lexical_cast<std::string>(update_count_);
+    status.values.push_back(value);
+    value.key = "UpdateChild mean (us)";
+    value.value = boost::lexical_cast<std::string>(update_us);
+    status.values.push_back(value);
+    value.key = "UpdateChild mean per robot (us)";
+    value.value = boost::lexical_cast<std::string>(robots > 0 ? update_us / robots : 0.0);
+    status.values.push_back(value);
+    value.key = "Robots";
+    value.value = boost::lexical_cast<std::string>(robots);
+    status.values.push_back(value);
+    value.key = "Sleeping robots";
+    value.value = boost::lexical_cast<std::string>(sleeping);
+    status.values.push_back(value);
+
+    diagnostics.status.push_back(status);
+    diagnostics_pub_.publish(diagnostics);
+  }
+
+  void GazeboRosForceBasedMoveFleet::Reset()
+  {
+    step_clock_.set(world_->SimTime());
+    odometry_scheduler_.restart(world_->SimTime());
+    for (size_t i = 0; i < models_.size(); ++i)
+    {
+      if (idle_sleeps_[i].asleep())
+        wakeUp(i);
+      clearCommand(i);
+      odom_x_[i] = 0.0;
+      odom_y_[i] = 0.0;
+      odom_yaw_[i] = 0.0;
+      odom_accumulators_[i].reset();
+      odom_noises_[i].configure(odom_noises_[i].parameters());
+      controllers_[i].reset(0.0, 0.0, 0.0);
+    }
+  }
+
+  void GazeboRosForceBasedMoveFleet::clearCommand(size_t index)
+  {
+    CommandMailbox::Command stale;
+    mailboxes_[index]->read(stale);
+    cmd_x_[index] = 0.0;
+    cmd_y_[index] = 0.0;
+    cmd_rot_[index] = 0.0;
+    cmd_time_[index] = common::Time();
+    trajectory_mailboxes_[index]->read(trajectories_[index]);
+    trajectories_[index].clear();
+  }
+
+  void GazeboRosForceBasedMoveFleet::fallAsleep(size_t index)
+  {
+    // Forces from this step would wake the bodies again right away.
+    models_[index]->ResetPhysicsStates();
+    models_[index]->SetEnabled(false);
+    idle_sleeps_[index].sleep();
+  }
+
+  void GazeboRosForceBasedMoveFleet::wakeUp(size_t index)
+  {
+    models_[index]->SetEnabled(true);
+    idle_sleeps_[index].wake();
+  }
+
+  bool GazeboRosForceBasedMoveFleet::applySnapshotAction(SnapshotHandoff::Action action)
+  {
+    if (action == SnapshotHandoff::kCapture) {
+      model_snapshots_.clear();
+      physics::Model_V models = world_->Models();
+      for (physics::Model_V::const_iterator it = models.begin(); it != models.end(); ++it)
+      {
+        if ((*it)->IsStatic())
+          continue;
+        model_snapshots_.push_back(std::make_pair(*it, ModelSnapshot()));
+        model_snapshots_.back().second.capture(*it);
+      }
+
+      robot_snapshots_.clear();
+      for (size_t i = 0; i < models_.size(); ++i)
+      {
+        RobotSnapshot robot;
+        robot.model = models_[i];
+        robot.odom_x = odom_x_[i];
+        robot.odom_y = odom_y_[i];
+        robot.odom_yaw = odom_yaw_[i];
+        robot.odom_accumulator = odom_accumulators_[i];
+        robot.odom_noise = odom_noises_[i];
+        robot.controller = controllers_[i];
+        robot_snapshots_.push_back(robot);
+      }
+      has_snapshot_ = true;
+      return true;
+    }
+
+    if (!has_snapshot_)
+      return false;
+    for (size_t i = 0; i < models_.size(); ++i)
+    {
+      if (idle_sleeps_[i].asleep())
+        wakeUp(i);
+    }
+    // Models deleted since the snapshot stay deleted, models spawned since
+    // keep their current state.
+    for (size_t i = 0; i < model_snapshots_.size(); ++i)
+    {
+      const physics::ModelPtr& model = model_snapshots_[i].first;
+      if (world_->ModelByName(model->GetName()) == model)
+        model_snapshots_[i].second.restore(model);
+    }
+
+    for (size_t i = 0; i < models_.size(); ++i)
+    {
+      // Commands addressed the pre-restore episode.
+      clearCommand(i);
+      for (size_t j = 0; j < robot_snapshots_.size(); ++j)
+      {
+        const RobotSnapshot& robot = robot_snapshots_[j];
+        if (robot.model != models_[i])
+          continue;
+        odom_x_[i] = robot.odom_x;
+        odom_y_[i] = robot.odom_y;
+        odom_yaw_[i] = robot.odom_yaw;
+        odom_accumulators_[i] = robot.odom_accumulator;
+        odom_noises_[i] = robot.odom_noise;
+        controllers_[i] = robot.controller;
+        break;
+      }
+    }
+    return true;
+  }
+
+  bool GazeboRosForceBasedMoveFleet::snapshotCallback(std_srvs::Trigger::Request& request,
+                                                      std_srvs::Trigger::Response& response)
+  {
+    response.success = snapshot_handoff_.request(SnapshotHandoff::kCapture, world_,
+        boost::bind(&GazeboRosForceBasedMoveFleet::applySnapshotAction, this, _1));
+    response.message = response.success ? "snapshot taken" : "shutting down";
+    return true;
+  }
+
+  bool GazeboRosForceBasedMoveFleet::restoreCallback(std_srvs::Trigger::Request& request,
+                                                     std_srvs::Trigger::Response& response)
+  {
+    response.success = snapshot_handoff_.request(SnapshotHandoff::kRestore, world_,
+        boost::bind(&GazeboRosForceBasedMoveFleet::applySnapshotAction, this, _1));
+    response.message = response.success ? "snapshot restored" : "no snapshot taken yet";
+    return true;
+  }
+
+  void GazeboRosForceBasedMoveFleet::publishOdometry(size_t index, double step_time, const ros::Time& stamp,
+                                                     bool last_of_step)
+  {
+    const ignition::math::Vector3d angular_vel = models_[index]->RelativeAngularVel();
+    const ignition::math::Vector3d linear_vel = models_[index]->RelativeLinearVel();
+
+    if (ground_truth_odometry_) {
+      // Planar pose relative to the spawn pose, with the seeded error
+      // applied in the odom frame.
+      const ignition::math::Pose3d& spawn = spawn_poses_[index];
+      const ignition::math::Pose3d pose = models_[index]->WorldPose();
+      const ignition::math::Vector3d offset = spawn.Rot().RotateVectorReverse(pose.Pos() - spawn.Pos());
+      const double true_yaw = (spawn.Rot().Inverse() * pose.Rot()).Yaw();
+      const Se2Delta error = odom_noises_[index].sample(step_time);
+      odom_x_[index] = error.x + offset.X()*cos(error.yaw) - offset.Y()*sin(error.yaw);
+      odom_y_[index] = error.y + offset.X()*sin(error.yaw) + offset.Y()*cos(error.yaw);
+      odom_yaw_[index] = atan2(sin(true_yaw + error.yaw), cos(true_yaw + error.yaw));
+    } else {
+      // Same motion models as GazeboRosForceBasedMove, kept in planar form
+      // per robot.
+      Se2Delta motion;
+      if (per_step_odometry_) {
+        if (last_of_step)
+          motion = odom_accumulators_[index].take();
+      } else if (first_order_odometry_) {
+        motion = integrateTwistFirstOrder(linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_time);
+      } else {
+        motion = integrateTwist(linear_vel.X(), linear_vel.Y(), angular_vel.Z(), step_time);
+      }
+
+      const double yaw = odom_yaw_[index];
+      odom_x_[index] += motion.x*cos(yaw) - motion.y*sin(yaw);
+      odom_y_[index] += motion.x*sin(yaw) + motion.y*cos(yaw);
+      odom_yaw_[index] = atan2(sin(yaw + motion.yaw), cos(yaw + motion.yaw));
+    }
+
+    nav_msgs::Odometry& odom = odom_msgs_[index];
+    odom.header.stamp = stamp;
+    odom.pose.pose.position.x = odom_x_[index];
+    odom.pose.pose.position.y = odom_y_[index];
+    odom.pose.pose.orientation.z = sin(odom_yaw_[index] / 2.0);
+    odom.pose.pose.orientation.w = cos(odom_yaw_[index] / 2.0);
+    odom.twist.twist.angular.z = angular_vel.Z();
+    odom.twist.twist.linear.x = linear_vel.X();
+    odom.twist.twist.linear.y = linear_vel.Y();
+
+    const double yaw_covariance = (std::abs(angular_vel.Z()) < 0.0001) ? 0.01 : 100.0;
+    odom.pose.covariance[35] = yaw_covariance;
+    odom.twist.covariance[35] = yaw_covariance;
+
+    if (publish_odometry_tf_) {
+      geometry_msgs::TransformStamped& transform = odom_transforms_[index];
+      transform.header.stamp = stamp;
+      transform.transform.translation.x = odom.pose.pose.position.x;
+      transform.transform.translation.y = odom.pose.pose.position.y;
+      transform.transform.rotation = odom.pose.pose.orientation;
+    }
+
+    if (odometry_pools_[index]) {
+      OdometryPool::Ptr pooled = odometry_pools_[index]->acquire();
+      pooled->header.stamp = odom.header.stamp;
+      pooled->pose = odom.pose;
+      pooled->twist = odom.twist;
+      odometry_pubs_[index].publish(pooled);
+    } else {
+      odometry_pubs_[index].publish(odom);
+    }
+  }
+
+  void GazeboRosForceBasedMoveFleet::trajectoryCallback(
+      const trajectory_msgs::MultiDOFJointTrajectory::ConstPtr& trajectory_msg,
+      const boost::shared_ptr<TrajectoryMailbox>& mailbox)
+  {
+    const common::Time sim_time = step_clock_.now();
+    mailbox->write(*trajectory_msg, ros::Time(sim_time.sec, sim_time.nsec));
+  }
+
+  void GazeboRosForceBasedMoveFleet::cmdVelCallback(
+      const geometry_msgs::Twist::ConstPtr& cmd_msg,
+      const boost::shared_ptr<CommandMailbox>& mailbox)
+  {
+    CommandMailbox::Command cmd;
+    cmd.x = cmd_msg->linear.x;
+    cmd.y = cmd_msg->linear.y;
+    cmd.rot = cmd_msg->angular.z;
+    cmd.stamp = step_clock_.now();
+    mailbox->write(cmd);
+  }
+
+  void GazeboRosForceBasedMoveFleet::QueueThread()
+  {
+    static const double timeout = 0.01;
+    while (alive_ && rosnode_->ok())
+    {
+      queue_.callAvailable(ros::WallDuration(timeout));
+    }
+  }
+
+  GZ_REGISTER_WORLD_PLUGIN(GazeboRosForceBasedMoveFleet)
+}
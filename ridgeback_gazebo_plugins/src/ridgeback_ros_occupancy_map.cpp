@@ -0,0 +1,621 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+/*
+ * Desc: World plugin serving an occupancy grid of the world's collision
+ *       geometry, so planners can start from a map without SLAM.
+ */
+
+#include <ridgeback_gazebo_plugins/ridgeback_ros_occupancy_map.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <cmath>
+#include <fstream>
+
+namespace gazebo
+{
+
+  namespace
+  {
+    // FNV-1a, 64 bit.
+    const uint64_t kHashOffset = 14695981039346656037ULL;
+    const uint64_t kHashPrime = 1099511628211ULL;
+
+    uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+    {
+      const unsigned char* bytes = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= kHashPrime;
+      }
+      return hash;
+    }
+
+    template<typename T>
+    uint64_t hashValue(uint64_t hash, const T& value)
+    {
+      return hashBytes(hash, &value, sizeof(value));
+    }
+
+    uint64_t hashString(uint64_t hash, const std::string& value)
+    {
+      return hashBytes(hashValue(hash, value.size()), value.data(), value.size());
+    }
+
+    /// \brief Layout of a cache file: this header, then width * height cells.
+    struct CacheHeader {
+      static const uint32_t kMagic = 0x474f4252;  // "RBOG"
+      static const uint32_t kVersion = 1;
+
+      uint32_t magic;
+      uint32_t version;
+      uint32_t width;
+      uint32_t height;
+      uint64_t key;
+      double resolution;
+      double origin_x;
+      double origin_y;
+    };
+
+    /// \brief mkdir -p
+    bool makeDirectories(const std::string& path)
+    {
+      for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        const std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+          return false;
+        if (slash == std::string::npos)
+          return true;
+      }
+    }
+
+    void addVertex(const ignition::math::Pose3d& pose, const ignition::math::Vector3d& local,
+                   std::vector<OccupancyRaster::Vertex>* triangles)
+    {
+      const ignition::math::Vector3d world = pose.Pos() + pose.Rot().RotateVector(local);
+      OccupancyRaster::Vertex vertex = {world.X(), world.Y(), world.Z()};
+      triangles->push_back(vertex);
+    }
+
+    /// \brief Highest ground triangle above or below x, y.
+    bool groundHeight(const std::vector<OccupancyRaster::Vertex>& ground, double x, double y, double* z)
+    {
+      bool found = false;
+      for (size_t i = 0; i + 2 < ground.size(); i += 3) {
+        const OccupancyRaster::Vertex& a = ground[i];
+        const OccupancyRaster::Vertex& b = ground[i + 1];
+        const OccupancyRaster::Vertex& c = ground[i + 2];
+        const double det = (b.y - c.y) * (a.x - c.x) + (c.x - b.x) * (a.y - c.y);
+        if (det == 0.0)
+          continue;
+        const double u = ((b.y - c.y) * (x - c.x) + (c.x - b.x) * (y - c.y)) / det;
+        const double v = ((c.y - a.y) * (x - c.x) + (a.x - c.x) * (y - c.y)) / det;
+        if (u < 0.0 || v < 0.0 || u + v > 1.0)
+          continue;
+        const double height = u * a.z + v * b.z + (1.0 - u - v) * c.z;
+        if (!found || height > *z)
+          *z = height;
+        found = true;
+      }
+      return found;
+    }
+  }
+
+  GazeboRosOccupancyMap::GazeboRosOccupancyMap()
+    : alive_(false), publish_pending_(false), padding_(1.0), threads_(0),
+      max_cells_(25000000), publish_map_(true), world_hash_(kHashOffset),
+      last_key_(0), has_last_map_(false), warned_unsupported_(false) {}
+
+  GazeboRosOccupancyMap::~GazeboRosOccupancyMap()
+  {
+    alive_ = false;
+    queue_.clear();
+    queue_.disable();
+    if (rosnode_)
+      rosnode_->shutdown();
+    if (callback_queue_thread_.joinable())
+      callback_queue_thread_.join();
+  }
+
+  void GazeboRosOccupancyMap::Load(physics::WorldPtr world, sdf::ElementPtr sdf)
+  {
+    world_ = world;
+
+    /* Parse parameters */
+
+    frame_id_ = "map";
+    if (sdf->HasElement("frameId"))
+      frame_id_ = sdf->GetElement("frameId")->Get<std::string>();
+
+    std::string map_topic = "map";
+    if (sdf->HasElement("mapTopic"))
+      map_topic = sdf->GetElement("mapTopic")->Get<std::string>();
+
+    robot_prefix_ = "ridgeback";
+    if (sdf->HasElement("robotPrefix"))
+      robot_prefix_ = sdf->GetElement("robotPrefix")->Get<std::string>();
+
+    if (sdf->HasElement("groundModel"))
+      ground_model_ = sdf->GetElement("groundModel")->Get<std::string>();
+
+    default_request_.resolution = 0.05;
+    if (sdf->HasElement("resolution"))
+      default_request_.resolution = sdf->GetElement("resolution")->Get<double>();
+    if (default_request_.resolution <= 0.0)
+    {
+      ROS_WARN("OccupancyMapPlugin <resolution> must be positive, defaults to 0.05");
+      default_request_.resolution = 0.05;
+    }
+
+    // The band a Ridgeback body sweeps, clear of the floor itself.
+    default_request_.min_height = 0.1;
+    if (sdf->HasElement("minHeight"))
+      default_request_.min_height = sdf->GetElement("minHeight")->Get<double>();
+
+    default_request_.max_height = 0.5;
+    if (sdf->HasElement("maxHeight"))
+      default_request_.max_height = sdf->GetElement("maxHeight")->Get<double>();
+    if (default_request_.max_height < default_request_.min_height)
+    {
+      ROS_WARN("OccupancyMapPlugin <maxHeight> below <minHeight>, using <minHeight> for both");
+      default_request_.max_height = default_request_.min_height;
+    }
+
+    if (sdf->HasElement("padding"))
+      padding_ = std::max(0.0, sdf->GetElement("padding")->Get<double>());
+
+    if (sdf->HasElement("threads"))
+      threads_ = sdf->GetElement("threads")->Get<unsigned int>();
+
+    if (sdf->HasElement("maxCells"))
+      max_cells_ = sdf->GetElement("maxCells")->Get<unsigned int>();
+
+    if (sdf->HasElement("publishMap"))
+      publish_map_ = sdf->GetElement("publishMap")->Get<bool>();
+
+    // Next to the other ROS state by default; an empty element disables it.
+    const char* ros_home = getenv("ROS_HOME");
+    const char* home = getenv("HOME");
+    if (ros_home)
+      cache_directory_ = std::string(ros_home) + "/occupancy_maps";
+    else if (home)
+      cache_directory_ = std::string(home) + "/.ros/occupancy_maps";
+    if (sdf->HasElement("cacheDirectory"))
+      cache_directory_ = sdf->GetElement("cacheDirectory")->Get<std::string>();
+
+    world_hash_ = hashString(kHashOffset, world_->SDF()->ToString(""));
+
+    // Ensure that ROS has been initialized
+    if (!ros::isInitialized())
+    {
+      ROS_FATAL_STREAM("OccupancyMapPlugin: A ROS node for Gazebo has not been initialized, "
+        << "unable to load plugin. Load the Gazebo system plugin "
+        << "'libgazebo_ros_api_plugin.so' in the gazebo_ros package)");
+      return;
+    }
+    rosnode_.reset(new ros::NodeHandle());
+    rosnode_->setCallbackQueue(&queue_);
+
+    map_pub_ = rosnode_->advertise<nav_msgs::OccupancyGrid>(map_topic, 1, true);
+
+    ros::AdvertiseServiceOptions grid_so =
+      ros::AdvertiseServiceOptions::create<ridgeback_gazebo_plugins::GetOccupancyGrid>("get_occupancy_grid",
+          boost::bind(&GazeboRosOccupancyMap::getOccupancyGridCallback, this, _1, _2),
+          ros::VoidPtr(), &queue_);
+    get_occupancy_grid_srv_ = rosnode_->advertiseService(grid_so);
+    ros::AdvertiseServiceOptions static_map_so =
+      ros::AdvertiseServiceOptions::create<nav_msgs::GetMap>("static_map",
+          boost::bind(&GazeboRosOccupancyMap::staticMapCallback, this, _1, _2),
+          ros::VoidPtr(), &queue_);
+    static_map_srv_ = rosnode_->advertiseService(static_map_so);
+
+    alive_ = true;
+    callback_queue_thread_ =
+      boost::thread(boost::bind(&GazeboRosOccupancyMap::QueueThread, this));
+
+    ROS_INFO("OccupancyMapPlugin serving %.3f m maps of %.2f m to %.2f m above %s, cache %s",
+        default_request_.resolution, default_request_.min_height, default_request_.max_height,
+        ground_model_.empty() ? "z = 0" : ground_model_.c_str(),
+        cache_directory_.empty() ? "disabled" : cache_directory_.c_str());
+  }
+
+  void GazeboRosOccupancyMap::Init()
+  {
+    // Load() runs before the models of the world file are initialized.
+    if (alive_ && publish_map_)
+      publish_pending_ = true;
+  }
+
+  void GazeboRosOccupancyMap::collectGeometry(std::vector<Geometry>* geometry)
+  {
+    boost::recursive_mutex::scoped_lock lock(*world_->Physics()->GetPhysicsUpdateMutex());
+    const physics::Model_V models = world_->Models();
+    for (size_t i = 0; i < models.size(); ++i) {
+      if (!robot_prefix_.empty() && models[i]->GetName().compare(0, robot_prefix_.size(), robot_prefix_) == 0)
+        continue;
+      collectModel(models[i], !ground_model_.empty() && models[i]->GetName() == ground_model_, geometry);
+    }
+  }
+
+  void GazeboRosOccupancyMap::collectModel(const physics::ModelPtr& model, bool ground,
+      std::vector<Geometry>* geometry)
+  {
+    const physics::Link_V& links = model->GetLinks();
+    for (size_t i = 0; i < links.size(); ++i) {
+      const physics::Collision_V& collisions = links[i]->GetCollisions();
+      for (size_t j = 0; j < collisions.size(); ++j) {
+        const physics::CollisionPtr& collision = collisions[j];
+        const physics::ShapePtr shape = collision->GetShape();
+        Geometry g;
+        g.pose = collision->WorldPose();
+        g.mesh = NULL;
+        g.ground = ground;
+
+        if (physics::BoxShapePtr box = boost::dynamic_pointer_cast<physics::BoxShape>(shape)) {
+          g.shape = kBox;
+          g.size = box->Size();
+        } else if (physics::CylinderShapePtr cylinder = boost::dynamic_pointer_cast<physics::CylinderShape>(shape)) {
+          g.shape = kCylinder;
+          g.size.Set(cylinder->GetRadius(), cylinder->GetRadius(), cylinder->GetLength());
+        } else if (physics::SphereShapePtr sphere = boost::dynamic_pointer_cast<physics::SphereShape>(shape)) {
+          g.shape = kSphere;
+          g.size.Set(sphere->GetRadius(), sphere->GetRadius(), sphere->GetRadius());
+        } else if (physics::MeshShapePtr mesh = boost::dynamic_pointer_cast<physics::MeshShape>(shape)) {
+          g.shape = kMesh;
+          g.size = mesh->Size();
+          g.uri = common::find_file(mesh->GetMeshURI());
+          if (!g.uri.empty())
+            g.mesh = common::MeshManager::Instance()->Load(g.uri);
+          if (!g.mesh) {
+            ROS_WARN("OccupancyMapPlugin cannot load mesh \"%s\" of %s, left out of the map",
+                mesh->GetMeshURI().c_str(), collision->GetScopedName().c_str());
+            continue;
+          }
+        } else {
+          // The ground plane is below any useful band anyway.
+          if (!boost::dynamic_pointer_cast<physics::PlaneShape>(shape) && !warned_unsupported_) {
+            ROS_WARN("OccupancyMapPlugin only rasterizes boxes, cylinders, spheres and meshes, "
+                "%s and any other such collisions are left out of the map", collision->GetScopedName().c_str());
+            warned_unsupported_ = true;
+          }
+          continue;
+        }
+        geometry->push_back(g);
+      }
+    }
+
+    const physics::Model_V nested = model->NestedModels();
+    for (size_t i = 0; i < nested.size(); ++i)
+      collectModel(nested[i], ground, geometry);
+  }
+
+  uint64_t GazeboRosOccupancyMap::cacheKey(const std::vector<Geometry>& geometry, const Request& request) const
+  {
+    uint64_t hash = hashValue(world_hash_, static_cast<uint32_t>(CacheHeader::kVersion));
+    hash = hashValue(hash, request.resolution);
+    hash = hashValue(hash, request.min_height);
+    hash = hashValue(hash, request.max_height);
+    hash = hashValue(hash, padding_);
+    for (size_t i = 0; i < geometry.size(); ++i) {
+      const Geometry& g = geometry[i];
+      const double values[] = {
+        g.pose.Pos().X(), g.pose.Pos().Y(), g.pose.Pos().Z(),
+        g.pose.Rot().W(), g.pose.Rot().X(), g.pose.Rot().Y(), g.pose.Rot().Z(),
+        g.size.X(), g.size.Y(), g.size.Z()
+      };
+      hash = hashValue(hash, static_cast<uint32_t>(g.shape));
+      hash = hashValue(hash, static_cast<uint8_t>(g.ground));
+      hash = hashBytes(hash, values, sizeof(values));
+      if (g.shape == kMesh) {
+        // A regenerated mesh, e.g. by simplify_media, keeps its name.
+        hash = hashString(hash, g.uri);
+        struct stat info;
+        if (stat(g.uri.c_str(), &info) == 0) {
+          hash = hashValue(hash, static_cast<int64_t>(info.st_size));
+          hash = hashValue(hash, static_cast<int64_t>(info.st_mtime));
+        }
+      }
+    }
+    return hash;
+  }
+
+  bool GazeboRosOccupancyMap::readCache(uint64_t key, nav_msgs::OccupancyGrid* map) const
+  {
+    if (cache_directory_.empty())
+      return false;
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.grid", static_cast<unsigned long long>(key));
+    std::ifstream file((cache_directory_ + name).c_str(), std::ios::binary);
+    CacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != CacheHeader::kMagic || header.version != CacheHeader::kVersion || header.key != key ||
+        static_cast<uint64_t>(header.width) * header.height > max_cells_)
+      return false;
+
+    map->data.resize(static_cast<size_t>(header.width) * header.height);
+    if (!file.read(reinterpret_cast<char*>(map->data.data()), map->data.size()))
+      return false;
+    map->info.resolution = header.resolution;
+    map->info.width = header.width;
+    map->info.height = header.height;
+    map->info.origin.position.x = header.origin_x;
+    map->info.origin.position.y = header.origin_y;
+    map->info.origin.position.z = 0.0;
+    map->info.origin.orientation.w = 1.0;
+    return true;
+  }
+
+  void GazeboRosOccupancyMap::writeCache(uint64_t key, const nav_msgs::OccupancyGrid& map) const
+  {
+    if (cache_directory_.empty())
+      return;
+    if (!makeDirectories(cache_directory_)) {
+      ROS_WARN("OccupancyMapPlugin cannot create cache directory %s", cache_directory_.c_str());
+      return;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.grid", static_cast<unsigned long long>(key));
+    const std::string path = cache_directory_ + name;
+    const std::string partial = path + ".partial";
+
+    CacheHeader header;
+    header.magic = CacheHeader::kMagic;
+    header.version = CacheHeader::kVersion;
+    header.width = map.info.width;
+    header.height = map.info.height;
+    header.key = key;
+    header.resolution = map.info.resolution;
+    header.origin_x = map.info.origin.position.x;
+    header.origin_y = map.info.origin.position.y;
+    {
+      std::ofstream file(partial.c_str(), std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char*>(map.data.data()), map.data.size());
+      if (!file) {
+        ROS_WARN("OccupancyMapPlugin cannot write %s", partial.c_str());
+        remove(partial.c_str());
+        return;
+      }
+    }
+    // Other gzservers sharing the cache only ever see complete files.
+    if (rename(partial.c_str(), path.c_str()) != 0)
+      remove(partial.c_str());
+  }
+
+  void GazeboRosOccupancyMap::triangulate(const Geometry& g,
+      std::vector<OccupancyRaster::Vertex>* triangles)
+  {
+    typedef ignition::math::Vector3d V;
+    switch (g.shape) {
+      case kBox:
+      {
+        static const int faces[12][3] = {
+          {0, 1, 3}, {0, 3, 2}, {4, 5, 7}, {4, 7, 6}, {0, 1, 5}, {0, 5, 4},
+          {2, 3, 7}, {2, 7, 6}, {0, 2, 6}, {0, 6, 4}, {1, 3, 7}, {1, 7, 5}
+        };
+        for (int f = 0; f < 12; ++f) {
+          for (int k = 0; k < 3; ++k) {
+            const int c = faces[f][k];
+            addVertex(g.pose, V((c & 1 ? 0.5 : -0.5) * g.size.X(),
+                                (c & 2 ? 0.5 : -0.5) * g.size.Y(),
+                                (c & 4 ? 0.5 : -0.5) * g.size.Z()), triangles);
+          }
+        }
+        break;
+      }
+      case kCylinder:
+      {
+        // Polygon around the circle, so the map errs on the occupied side.
+        static const int segments = 32;
+        const double radius = g.size.X() / std::cos(M_PI / segments);
+        const double half = 0.5 * g.size.Z();
+        for (int i = 0; i < segments; ++i) {
+          const double a0 = 2.0 * M_PI * i / segments;
+          const double a1 = 2.0 * M_PI * (i + 1) / segments;
+          const V b0(radius * std::cos(a0), radius * std::sin(a0), -half);
+          const V b1(radius * std::cos(a1), radius * std::sin(a1), -half);
+          const V t0(b0.X(), b0.Y(), half);
+          const V t1(b1.X(), b1.Y(), half);
+          const V corners[12] = {b0, b1, t1, b0, t1, t0, V(0, 0, -half), b1, b0, V(0, 0, half), t0, t1};
+          for (int k = 0; k < 12; ++k)
+            addVertex(g.pose, corners[k], triangles);
+        }
+        break;
+      }
+      case kSphere:
+      {
+        static const int slices = 24;
+        static const int stacks = 12;
+        const double radius = g.size.X() / (std::cos(M_PI / slices) * std::cos(M_PI / (2 * stacks)));
+        for (int s = 0; s < stacks; ++s) {
+          const double p0 = M_PI * s / stacks - 0.5 * M_PI;
+          const double p1 = M_PI * (s + 1) / stacks - 0.5 * M_PI;
+          for (int i = 0; i < slices; ++i) {
+            const double a0 = 2.0 * M_PI * i / slices;
+            const double a1 = 2.0 * M_PI * (i + 1) / slices;
+            const V v00(radius * std::cos(p0) * std::cos(a0), radius * std::cos(p0) * std::sin(a0), radius * std::sin(p0));
+            const V v01(radius * std::cos(p0) * std::cos(a1), radius * std::cos(p0) * std::sin(a1), radius * std::sin(p0));
+            const V v10(radius * std::cos(p1) * std::cos(a0), radius * std::cos(p1) * std::sin(a0), radius * std::sin(p1));
+            const V v11(radius * std::cos(p1) * std::cos(a1), radius * std::cos(p1) * std::sin(a1), radius * std::sin(p1));
+            const V corners[6] = {v00, v01, v11, v00, v11, v10};
+            for (int k = 0; k < 6; ++k)
+              addVertex(g.pose, corners[k], triangles);
+          }
+        }
+        break;
+      }
+      case kMesh:
+      {
+        for (unsigned int i = 0; i < g.mesh->GetSubMeshCount(); ++i) {
+          const common::SubMesh* submesh = g.mesh->GetSubMesh(i);
+          if (submesh->GetPrimitiveType() != common::SubMesh::TRIANGLES)
+            continue;
+          const unsigned int count = submesh->GetIndexCount() / 3 * 3;
+          for (unsigned int k = 0; k < count; ++k) {
+            const V vertex = submesh->Vertex(submesh->GetIndex(k));
+            addVertex(g.pose, V(vertex.X() * g.size.X(), vertex.Y() * g.size.Y(), vertex.Z() * g.size.Z()), triangles);
+          }
+        }
+        break;
+      }
+    }
+  }
+
+  bool GazeboRosOccupancyMap::buildMap(const Request& request, nav_msgs::OccupancyGrid* map,
+      bool* cached, std::string* message)
+  {
+    const common::Time start = common::Time::GetWallTime();
+    std::vector<Geometry> geometry;
+    collectGeometry(&geometry);
+    const uint64_t key = cacheKey(geometry, request);
+
+    *cached = true;
+    if (has_last_map_ && key == last_key_) {
+      *map = last_map_;
+    } else if (!readCache(key, map)) {
+      *cached = false;
+
+      std::vector<std::vector<OccupancyRaster::Vertex> > solids(geometry.size());
+      double min_x = HUGE_VAL, min_y = HUGE_VAL, max_x = -HUGE_VAL, max_y = -HUGE_VAL;
+      for (size_t i = 0; i < geometry.size(); ++i) {
+        triangulate(geometry[i], &solids[i]);
+        for (size_t k = 0; k < solids[i].size(); ++k) {
+          min_x = std::min(min_x, solids[i][k].x);
+          max_x = std::max(max_x, solids[i][k].x);
+          min_y = std::min(min_y, solids[i][k].y);
+          max_y = std::max(max_y, solids[i][k].y);
+        }
+      }
+      if (min_x > max_x) {
+        *message = "no collision geometry to rasterize";
+        return false;
+      }
+
+      // The map covers everything collidable, whether or not it reaches
+      // into the band, so free space around the obstacles is in it too.
+      const double origin_x = min_x - padding_;
+      const double origin_y = min_y - padding_;
+      const double width = std::ceil((max_x + padding_ - origin_x) / request.resolution);
+      const double height = std::ceil((max_y + padding_ - origin_y) / request.resolution);
+      if (width * height > max_cells_) {
+        *message = "map of " + boost::lexical_cast<std::string>(width) + " x " +
+          boost::lexical_cast<std::string>(height) + " cells is over <maxCells>";
+        return false;
+      }
+
+      std::vector<OccupancyRaster::Vertex> ground;
+      for (size_t i = 0; i < geometry.size(); ++i)
+        if (geometry[i].ground)
+          ground.insert(ground.end(), solids[i].begin(), solids[i].end());
+
+      OccupancyRaster raster(origin_x, origin_y, request.resolution,
+                             static_cast<unsigned int>(width), static_cast<unsigned int>(height));
+      for (size_t i = 0; i < geometry.size(); ++i) {
+        if (geometry[i].ground)
+          continue;
+        // Trees and rocks are small next to the terrain's hills, so one
+        // ground height under each collision is enough.
+        double offset = 0.0;
+        if (!ground.empty())
+          groundHeight(ground, geometry[i].pose.Pos().X(), geometry[i].pose.Pos().Y(), &offset);
+        raster.addSolid(solids[i], geometry[i].shape != kMesh,
+                        request.min_height + offset, request.max_height + offset);
+      }
+      raster.rasterize(threads_, &map->data);
+
+      map->info.resolution = request.resolution;
+      map->info.width = static_cast<unsigned int>(width);
+      map->info.height = static_cast<unsigned int>(height);
+      map->info.origin.position.x = origin_x;
+      map->info.origin.position.y = origin_y;
+      map->info.origin.position.z = 0.0;
+      map->info.origin.orientation.w = 1.0;
+      writeCache(key, *map);
+
+      ROS_INFO("OccupancyMapPlugin rasterized %zu collisions into %u x %u cells (%zu tiles) in %.1f ms",
+          geometry.size(), map->info.width, map->info.height, raster.tileCount(),
+          (common::Time::GetWallTime() - start).Double() * 1e3);
+    }
+
+    map->header.frame_id = frame_id_;
+    map->header.stamp = ros::Time::now();
+    map->info.map_load_time = map->header.stamp;
+    last_key_ = key;
+    last_map_ = *map;
+    has_last_map_ = true;
+    return true;
+  }
+
+  bool GazeboRosOccupancyMap::getOccupancyGridCallback(ridgeback_gazebo_plugins::GetOccupancyGrid::Request& req,
+      ridgeback_gazebo_plugins::GetOccupancyGrid::Response& res)
+  {
+    Request request = default_request_;
+    if (req.resolution > 0.0)
+      request.resolution = req.resolution;
+    if (req.min_height != 0.0 || req.max_height != 0.0) {
+      request.min_height = req.min_height;
+      request.max_height = req.max_height;
+    }
+    if (req.resolution < 0.0 || request.max_height < request.min_height) {
+      res.success = false;
+      res.message = "resolution must be positive and max_height at least min_height";
+      return true;
+    }
+    bool cached = false;
+    res.success = buildMap(request, &res.map, &cached, &res.message);
+    res.cached = cached;
+    return true;
+  }
+
+  bool GazeboRosOccupancyMap::staticMapCallback(nav_msgs::GetMap::Request& req, nav_msgs::GetMap::Response& res)
+  {
+    bool cached;
+    std::string message;
+    if (!buildMap(default_request_, &res.map, &cached, &message)) {
+      ROS_WARN("OccupancyMapPlugin cannot serve static_map: %s", message.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  void GazeboRosOccupancyMap::publishDefaultMap()
+  {
+    nav_msgs::OccupancyGrid map;
+    bool cached;
+    std::string message;
+    if (buildMap(default_request_, &map, &cached, &message))
+      map_pub_.publish(map);
+    else
+      ROS_WARN("OccupancyMapPlugin cannot publish a map: %s", message.c_str());
+  }
+
+  void GazeboRosOccupancyMap::QueueThread()
+  {
+    static const double timeout = 0.01;
+    while (alive_ && rosnode_->ok())
+    {
+      if (publish_pending_.exchange(false))
+        publishDefaultMap();
+      queue_.callAvailable(ros::WallDuration(timeout));
+    }
+  }
+
+  GZ_REGISTER_WORLD_PLUGIN(GazeboRosOccupancyMap)
+}
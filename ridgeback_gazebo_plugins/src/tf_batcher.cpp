@@ -0,0 +1,79 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <ridgeback_gazebo_plugins/tf_batcher.h>
+
+#include <boost/bind.hpp>
+
+namespace gazebo
+{
+
+  boost::mutex TfBatcher::instance_mutex_;
+  boost::weak_ptr<TfBatcher> TfBatcher::instance_;
+
+  boost::shared_ptr<TfBatcher> TfBatcher::acquire()
+  {
+    boost::mutex::scoped_lock scoped_lock(instance_mutex_);
+    boost::shared_ptr<TfBatcher> batcher = instance_.lock();
+    if (!batcher) {
+      batcher.reset(new TfBatcher());
+      instance_ = batcher;
+    }
+    return batcher;
+  }
+
+  TfBatcher::TfBatcher() : pending_count_(0)
+  {
+    // Same topic and queue size as tf2_ros::TransformBroadcaster.
+    tf_pub_ = rosnode_.advertise<tf2_msgs::TFMessage>("/tf", 100);
+    update_end_connection_ =
+      event::Events::ConnectWorldUpdateEnd(boost::bind(&TfBatcher::flush, this));
+  }
+
+  TfBatcher::~TfBatcher()
+  {
+    update_end_connection_.reset();
+    tf_pub_.shutdown();
+  }
+
+  void TfBatcher::add(const geometry_msgs::TransformStamped& transform)
+  {
+    boost::mutex::scoped_lock scoped_lock(pending_mutex_);
+    if (pending_count_ < pending_.size())
+      pending_[pending_count_] = transform;
+    else
+      pending_.push_back(transform);
+    ++pending_count_;
+  }
+
+  void TfBatcher::flush()
+  {
+    {
+      boost::mutex::scoped_lock scoped_lock(pending_mutex_);
+      if (pending_count_ == 0)
+        return;
+      // With the same transforms every update nothing is resized, and the
+      // published entries come back as the next pending_ to assign into.
+      // Frame ids of the same length or shorter then reuse their buffers;
+      // publish() still allocates to serialize.
+      pending_.resize(pending_count_);
+      batch_.transforms.swap(pending_);
+      pending_count_ = 0;
+    }
+
+    tf_pub_.publish(batch_);
+  }
+
+}